@@ -20,6 +20,7 @@
  */
 #include "ay_d19m.h"
 #include "decoder.c"
+#include "transmit.c"
 
 #include <linux/init.h>
 #include <linux/module.h>
@@ -32,6 +33,7 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>	/* copy_*_user */
 #include <linux/gpio.h>		// Required for the GPIO functions
+#include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>	// Required for the IRQ code
 #include <linux/timer.h>
 #include <linux/mutex.h>
@@ -40,11 +42,45 @@
 #include <linux/wait.h>
 #include <linux/delay.h>
 #include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
+#include <linux/moduleparam.h>
+#include <linux/hash.h>
+#include <linux/pm.h>
+#include <linux/pm_runtime.h>
+#include <linux/pm_wakeup.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/mm.h>
+#include <linux/sysfs.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <uapi/linux/sched/types.h>	/* struct sched_param */
+#endif
 
 static unsigned ay_d19m_power = AY_D19M_POWER;
 static unsigned ay_d19m_d0 = AY_D19M_D0;
 static unsigned ay_d19m_d1 = AY_D19M_D1;
 static unsigned ay_d19m_mode = SKW06RF;
+static int ay_d19m_prio = 0;
+static int ay_d19m_cpu = -1;
+static int ay_d19m_tx_d0 = -1;
+static int ay_d19m_tx_d1 = -1;
+static unsigned ay_d19m_tx_pulse = 50;
+static unsigned ay_d19m_tx_interval = 1000;
+static unsigned ay_d19m_tx_gap = 25;
+static bool ay_d19m_tx_pass = 0;
+static unsigned ay_d19m_dupwin = 0;
+static bool ay_d19m_wakeup = 0;
+static bool ay_d19m_batch = 0;
+static unsigned ay_d19m_poll = 0;
+static bool ay_d19m_trace = 0;
+static unsigned ay_d19m_pinwin = 0;
+static unsigned ay_d19m_wakerec = 1;
+static unsigned ay_d19m_wakeus = 0;
 
 
 module_param(ay_d19m_power, uint, 0644);
@@ -55,106 +91,448 @@ module_param(ay_d19m_d1, uint, 0644);
 MODULE_PARM_DESC(ay_d19m_d1, CLASS_NAME " DATA1 GPOI Port. Defaul GPIO26");
 module_param(ay_d19m_mode, uint, 0644);
 MODULE_PARM_DESC(ay_d19m_mode, CLASS_NAME " Keypad Transmission (0..7) Format. Default 0");
+module_param(ay_d19m_prio, int, 0644);
+MODULE_PARM_DESC(ay_d19m_prio, CLASS_NAME " SCHED_FIFO priority (1..99) of the threaded D0/D1 IRQs. Default 0, kernel default");
+module_param(ay_d19m_cpu, int, 0444);
+MODULE_PARM_DESC(ay_d19m_cpu, CLASS_NAME " CPU for the D0/D1 IRQs and the frame timer. Default -1, any CPU");
+module_param(ay_d19m_tx_d0, int, 0444);
+MODULE_PARM_DESC(ay_d19m_tx_d0, CLASS_NAME " TX DATA0 GPOI Port. Default -1, no TX");
+module_param(ay_d19m_tx_d1, int, 0444);
+MODULE_PARM_DESC(ay_d19m_tx_d1, CLASS_NAME " TX DATA1 GPOI Port. Default -1, no TX");
+module_param(ay_d19m_tx_pulse, uint, 0444);
+MODULE_PARM_DESC(ay_d19m_tx_pulse, CLASS_NAME " TX pulse width in us. Default 50");
+module_param(ay_d19m_tx_interval, uint, 0444);
+MODULE_PARM_DESC(ay_d19m_tx_interval, CLASS_NAME " TX bit interval in us. Default 1000");
+module_param(ay_d19m_tx_gap, uint, 0444);
+MODULE_PARM_DESC(ay_d19m_tx_gap, CLASS_NAME " TX gap between frames in ms. Default 25");
+module_param(ay_d19m_tx_pass, bool, 0644);
+MODULE_PARM_DESC(ay_d19m_tx_pass, CLASS_NAME " Pass received Wiegand frames through to TX. Default 0");
+module_param(ay_d19m_dupwin, uint, 0644);
+MODULE_PARM_DESC(ay_d19m_dupwin, CLASS_NAME " Suppress repeated card frames within ms. Default 0, off");
+module_param(ay_d19m_wakeup, bool, 0444);
+MODULE_PARM_DESC(ay_d19m_wakeup, CLASS_NAME " D0/D1 edges wake the system from sleep. Default 0");
+module_param(ay_d19m_batch, bool, 0444);
+MODULE_PARM_DESC(ay_d19m_batch, CLASS_NAME " Sample D0/D1 with one GPIO bank read per edge. Default 0");
+module_param(ay_d19m_poll, uint, 0444);
+MODULE_PARM_DESC(ay_d19m_poll, CLASS_NAME " Sample D0/D1 once per bit, n us (20 or more) into the pulse, after the first two edges of a frame. Default 0, IRQ per bit");
+module_param(ay_d19m_wakerec, uint, 0644);
+MODULE_PARM_DESC(ay_d19m_wakerec, CLASS_NAME " Wake the reader at n queued records, default for AYD19M_SET_COALESCE. Default 1");
+module_param(ay_d19m_wakeus, uint, 0644);
+MODULE_PARM_DESC(ay_d19m_wakeus, CLASS_NAME " or when the oldest record is us old, default for AYD19M_SET_COALESCE. Default 0, every record");
+module_param(ay_d19m_pinwin, uint, 0644);
+MODULE_PARM_DESC(ay_d19m_pinwin, CLASS_NAME " Hold a card up to ms for the PIN ended by '#', single key modes. Default 0, off");
+module_param(ay_d19m_trace, bool, 0644);
+MODULE_PARM_DESC(ay_d19m_trace, CLASS_NAME " Record D0/D1 edges and frames to debugfs " DEVICE_NAME "/trace*. Default 0");
 
 int ayd19m_major = 0;
 int ayd19m_minor = 0;
 
 struct timer_list wiegand_timeout;
 
-static const int wiegandLength[] = {26 - 1, 6 - 1, 6 - 1, 8 - 1, 26 - 1, 26 - 1, 26 - 1, 0, 0 };
-static const uint32_t wiegandMask = 0x80000000;
-static volatile uint32_t bitmsk;
-static volatile uint32_t data0;
-static volatile uint32_t data1;
+/*
+ * Wiegand edge log. The D0/D1 IRQs (on any CPU) and the poll timer append
+ * without lock, a slot is reserved by head and published by its seq.
+ * Only the frame timer reads, it owns tail.
+ */
+static struct
+{
+	atomic_t head;		// next slot to reserve, never reset
+	atomic_t open;		// frame timer armed
+	unsigned tail;		// next slot to decode
+	unsigned lost;		// edges overwritten before decoded
+	struct
+	{
+		ayd19m_edge_t e;	// level holds the D0/D1 sample, bit 0 D0, bit 1 D1
+		unsigned seq;		// slot position + 1 once e is written
+	} ring[AY_D19M_EDGES];
+} wlog;
+
+/*
+ * Edge trace, ay_d19m_trace. A relay channel with one debugfs file per CPU,
+ * records are ayd19m_trace_t. The seq of an edge is its position in the
+ * edge log, a frame record has the position of the first edge it did not
+ * take, so the trace splits frames where the frame timer did.
+ */
+static struct
+{
+	struct dentry *dir;
+	struct rchan *chan;
+	atomic_t seq;		// SK3X4MX edges logged
+} etrace;
+
+/*
+ * Phase-locked capture, ay_d19m_poll. The first two edges of a frame are
+ * IRQs and give its bit interval, then D0/D1 are masked and a hrtimer
+ * samples them once per bit, ay_d19m_poll us after the expected falling
+ * edge, until a sample finds no pulse.
+ */
+static struct
+{
+	struct hrtimer timer;
+	atomic_t active;	// polling, IRQs masked, claimed by one CPU
+	atomic64_t first;	// ktime ns of the first edge of the frame, 0 none
+	uint64_t bit;		// ns bit interval locked to
+	uint64_t since;		// ktime ns polling started
+	uint64_t rearm;		// ktime ns IRQs enabled again
+	uint64_t load;		// ktime ns module loaded
+	atomic_t irqs;		// edges taken by IRQ
+	atomic64_t irqns;	// ns spent in the IRQ handler
+	atomic_t windows;	// frames polled
+	atomic_t ticks;		// hrtimer samples
+	uint64_t pollns;	// ns in polling mode
+} pollst;
+
+// SK3X4MX, both edges of D0/D1 are logged with timestamp
+static int sk3x4mx = 0;
+static DEFINE_SPINLOCK(edgelock);
+static ayd19m_edge_t edgelog[AY_D19M_EDGES];
+static int edgecnt = 0;
+static int edgelevel[2] = { 1, 1 };
+static ayd19m_sk3x4mx_t skstate = SK3X4MX_INIT;
 
 DEFINE_MUTEX(rmutex);
 static int irqlineD0 = 0;
 static int irqlineD1 = 0;
+static int irqprio[2] = { 0, 0 };	// priority applied to the D0/D1 IRQ thread
+static struct gpio_desc *batchdesc[2];	// D0/D1 for the batched bank read
+
+static int isOpen = 0;		// files open
+
+/*
+ * Raw frame stored by the frame timer, it is decoded and formatted
+ * by the reader in process context.
+ */
+struct ayd19m_frame
+{
+	fmt f;				// formatter selected on completion
+	uint32_t code;		// D0 data bits or SK3X4MX key
+	int bits;
+	int mode;			// ay_d19m_mode on completion
+	uint64_t start;		// ktime ns of the first edge
+	uint64_t ts;		// ktime ns of completion
+	unsigned repeat;	// duplicates collapsed into this frame
+	unsigned seq;		// frame number, for the duplicates
+	int haspin;			// card with the PIN entered after it
+	char pin[AY_D19M_PINMAX + 1];
+};
+
+/*
+ * One per open file, every frame is queued to each reader it passes the
+ * filter of.
+ */
+struct ayd19m_reader
+{
+	struct list_head list;	// on readers
+	wait_queue_head_t wq;
+	spinlock_t lock;
+	struct ayd19m_frame ring[AY_D19M_RING];
+	unsigned head, tail;	// frames are added at tail by the frame timer
+	unsigned overrun;		// frames lost, ring full
+	int tlen;				// length of text incl. '\0', 0 if none
+	char text[MAX_READSZ + 1];	// oldest frame formatted, partly read
+	struct ayd19m_coalesce co;	// wakeup coalescing of this file
+	struct hrtimer wake;	// oldest record co.usecs old
+	int ready;				// reader woken, stays set until the ring is empty
+	int filtered;			// filter is not AYD19M_FILTER_ALL
+	struct ayd19m_filter filter;
+	unsigned dupslot[1 << AY_D19M_DUPHASH];	// ring index of the frame of each duptab entry
+};
+
+static LIST_HEAD(readers);
+static DEFINE_SPINLOCK(readerslock);	// readers, duptab and fseq
+static unsigned fseq = 0;				// frames queued
+
+/*
+ * Duplicate suppression, direct mapped on code and length. A hit within
+ * ay_d19m_dupwin ms of the last copy is collapsed into the queued frame.
+ */
+struct ayd19m_dup
+{
+	uint32_t code;
+	int bits;
+	uint64_t ts;		// last copy seen
+	unsigned seq;		// frame number of the queued copy
+};
+
+static struct ayd19m_dup duptab[1 << AY_D19M_DUPHASH];
+static unsigned dupdrop = 0;		// duplicates suppressed
+
+/*
+ * Card + PIN correlation, ay_d19m_pinwin. In the single key modes a card
+ * is held until '#' ends the PIN typed after it and queued as one record
+ * with the PIN, '*' clears the PIN. Without '#' in time, or on anything
+ * else, the card and the keys held are queued as read.
+ */
+struct ayd19m_held
+{
+	fmt f;
+	uint32_t code;
+	int bits;
+	uint64_t start;
+};
+
+static struct
+{
+	spinlock_t lock;
+	struct timer_list timer;	// ay_d19m_pinwin after the card
+	int held;					// card held
+	struct ayd19m_held card;
+	unsigned repeat;			// frames of the held card repeated within ay_d19m_dupwin
+	uint64_t last;				// ktime ns start of its last frame
+	int nkeys;
+	struct ayd19m_held key[AY_D19M_PINMAX];
+	char pin[AY_D19M_PINMAX + 1];
+	unsigned pairs;				// cards queued with PIN
+	unsigned long deadline;		// jiffies the PIN window of the held card ends
+} corr = { .lock = __SPIN_LOCK_UNLOCKED(corr.lock) };
+
+/*
+ * Power management. With ay_d19m_wakeup the D0/D1 IRQs are IRQF_NO_SUSPEND,
+ * the handler keeps logging edges through suspend and resume and the frame
+ * that wakes the system is captured from its first bit. Its first edge
+ * wakes the system by pm_wakeup_hard_event() (pm_system_wakeup()).
+ * enable_irq_wake() is kept for the GPIO controller to wake the SoC from
+ * deeper states, the IRQ core does not arm an IRQF_NO_SUSPEND line itself.
+ */
+static struct
+{
+	int irqwake;		// enable_irq_wake done on suspend, bit 0 D0, bit 1 D1
+	int asleep;			// between the suspend and resume callbacks
+	int suspended;		// next frame start is a wakeup
+	int wakeframe;		// frame in capture woke the system
+	uint64_t wakets;	// ktime ns of the waking edge
+	uint64_t resumets;	// ktime ns of the resume callback
+	unsigned wakeups;	// frames captured after a wakeup
+	uint64_t lat;		// ns waking edge to frame completion
+	uint64_t latmax;
+} pmstat;
+
+/*
+ * Status page, struct ayd19m_status in one zeroed page, read and mapped
+ * read only through the sysfs file status of the device. Observers do not
+ * open /dev/ayd19m, their reads take no record and keep the power as is.
+ * Updates are serialized by statuslock and bracketed by the odd/even seq
+ * in the page, as write_seqcount_begin()/write_seqcount_end().
+ */
+static struct ayd19m_status *status;
+static DEFINE_SPINLOCK(statuslock);
+static int powered = 0;			// reader power, runtime PM
+static unsigned biterrs = 0;	// Wiegand frames with D0/D1 mismatch
+static unsigned overruns = 0;	// records lost on full reader queues, readerslock
+
+/*
+ * Status page update, fr the frame just queued or NULL for the counters
+ * and state only. Any context, the frame is stored raw like in the reader
+ * queues, the observer formats it. The PIN of a card is left out.
+ */
+static void ay_d19m_status(const struct ayd19m_frame *fr)
+{
+	unsigned long flags;
+
+	if (!status) return;
+
+	spin_lock_irqsave(&statuslock, flags);
+	WRITE_ONCE(status->seq, status->seq + 1);
+	smp_wmb();
 
-static int isOpen = 0;
+	status->updated = ktime_get_ns();
+	if (fr)
+	{
+		status->ts = fr->ts;
+		status->start = fr->start;
+		status->code = fr->code;
+		status->bits = fr->bits;
+		status->mode = ay_d19m_mode;
+		status->frame = fr->seq;
+		status->format = fmt_mode(fr->f);
+		status->facility = UINT_MAX;
+		status->result = fmt_result(fr->f, fr->code, fr->bits, &status->facility);
+		status->haspin = fr->haspin;
+	}
+	status->power = READ_ONCE(powered);
+	status->suspended = READ_ONCE(pmstat.suspended);
+	status->files = READ_ONCE(isOpen);
+	status->frames = READ_ONCE(fseq);
+	status->biterrs = READ_ONCE(biterrs);
+	status->overruns = READ_ONCE(overruns);
+	status->dupdrop = READ_ONCE(dupdrop);
+	status->pinpairs = READ_ONCE(corr.pairs);
+	status->edges = atomic_read(&wlog.head);
+	status->edgeslost = READ_ONCE(wlog.lost);
+	status->irqs = atomic_read(&pollst.irqs);
+	status->windows = atomic_read(&pollst.windows);
+	status->ticks = atomic_read(&pollst.ticks);
+	status->wakeups = READ_ONCE(pmstat.wakeups);
+	status->wakelatmax = READ_ONCE(pmstat.latmax);
+
+	smp_wmb();
+	WRITE_ONCE(status->seq, status->seq + 1);
+	spin_unlock_irqrestore(&statuslock, flags);
+}
 
-struct list_head todo_list;
-wait_queue_head_t rqueue;
+static ssize_t ay_d19m_statusread(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf,
+        loff_t off, size_t count)
+{
+	unsigned long flags;
+	ssize_t n;
 
-struct todo_data
+	spin_lock_irqsave(&statuslock, flags);
+	n = memory_read_from_buffer(buf, count, &off, status, sizeof(*status));
+	spin_unlock_irqrestore(&statuslock, flags);
+	return n;
+}
+
+// the page is inserted with its reference, a mapping may outlive the module
+static int ay_d19m_statusmmap(struct file *filp, struct kobject *kobj, struct bin_attribute *attr,
+        struct vm_area_struct *vma)
 {
-	struct list_head node;
-	char data[MAX_READSZ + 1];
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE) return -EINVAL;
+	if (vma->vm_flags & VM_WRITE) return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(status));
+}
+
+static struct bin_attribute ay_d19m_statusattr = {
+	.attr = { .name = "status", .mode = 0444 },
+	.size = PAGE_SIZE,
+	.read = ay_d19m_statusread,
+	.mmap = ay_d19m_statusmmap,
 };
 
 static irqreturn_t ay_d19m_irqdata(int irq, void *dev);
+static enum hrtimer_restart ay_d19m_polltick(struct hrtimer *timer);
 static void wiegand_timeoutfunc(struct timer_list *timer);
+static void ayd19m_pintimeout(struct timer_list *timer);
 static int powerOn(void);
 static int powerOff(void);
 static int acquiresGPIO(void);
 static int releaseGPIO(void);
+static void ay_d19m_traceinit(void);
+static void ay_d19m_traceexit(void);
 
 
 static struct class* ay_d19m_Class = NULL; ///< The device-driver class struct pointer
 static struct device* ay_d19m_Device = NULL; ///< The device-driver device struct pointer
 
-static const fmt ffmt[] = {
-		fmt_wiegand26,
-		fmt_SKW06RF,
-		fmt_SKW06NP,
-		fmt_SKW08NC,
-		fmt_K4W26BF,
-		fmt_K5W26FC,
-		fmt_K6W26BCD,
-		fmt_SK3X4MX,
-		fmt_K8CDBCD
-};
+/*
+ * Data management: read and write.
+ */
+static int ayd19m_pending(struct ayd19m_reader *r)
+{
+	return r->tlen || READ_ONCE(r->head) != READ_ONCE(r->tail);
+}
+
+/*
+ * Like ayd19m_pending() but only once the coalescing condition was met,
+ * blocking read and poll wait for it.
+ */
+static int ayd19m_ready(struct ayd19m_reader *r)
+{
+	return r->tlen || READ_ONCE(r->ready);
+}
+
+// called with r->lock held, returns 1 if the reader is to be woken
+static int ayd19m_coalesce(struct ayd19m_reader *r, int full)
+{
+	unsigned n = r->tail - r->head;
+
+	if (r->ready || !n) return 0;
+	if (full || !r->co.usecs || n >= r->co.records)
+	{
+		hrtimer_try_to_cancel(&r->wake);
+		r->ready = 1;
+		r->co.wakeups++;
+		return 1;
+	}
+	if (n == 1) hrtimer_start(&r->wake, us_to_ktime(r->co.usecs), HRTIMER_MODE_REL);
+	return 0;
+}
 
-ayd19m_mode_t mode()
+static enum hrtimer_restart ayd19m_wakeexpired(struct hrtimer *timer)
 {
-	return ay_d19m_mode;
+	struct ayd19m_reader *r = container_of(timer, struct ayd19m_reader, wake);
+	unsigned long flags;
+	int wake = 0;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (!r->ready && r->tail != r->head)
+	{
+		r->ready = 1;
+		r->co.wakeups++;
+		wake = 1;
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	if (wake) wake_up(&r->wq);
+	return HRTIMER_NORESTART;
 }
+
 /*
- * Data management: read and write.
+ * Take the oldest raw frame and format it into r->text.
+ * Returns the text length incl. '\0', 0 if there is no frame.
  */
+static int ayd19m_format(struct ayd19m_reader *r)
+{
+	struct ayd19m_frame fr;
+	unsigned long flags;
+	int s;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (r->head == r->tail)
+	{
+		spin_unlock_irqrestore(&r->lock, flags);
+		return 0;
+	}
+	fr = r->ring[r->head++ % AY_D19M_RING];
+	if (r->head == r->tail) r->ready = 0;
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	s = fr.f(fr.code, fr.bits, r->text, sizeof(r->text) - 2, fr.mode);
+	if (fr.haspin) s += scnprintf(r->text + s, sizeof(r->text) - 2 - s, ", P=%s", fr.pin);
+	if (fr.repeat) s += scnprintf(r->text + s, sizeof(r->text) - 2 - s, ", N=%u", fr.repeat);
+	printk(KERN_INFO CLASS_NAME ": new key on mode %d, code %s\n", ay_d19m_mode, r->text);
+
+	r->text[s++] = '\n';
+	r->text[s++] = '\0';
+	return s;
+}
+
 ssize_t ayd19m_read(struct file *filp, char __user * buf, size_t count, loff_t * f_pos)
 {
 	ssize_t retval;
-	struct todo_data *data;
-	struct list_head *todo = (struct list_head *) filp->private_data;
+	struct ayd19m_reader *r = filp->private_data;
 	unsigned n;
 
 	printk(KERN_DEBUG CLASS_NAME ": read pbuf=%p, cnt=%d, off=%lld\n", buf, count, *f_pos);
 
 	if (!(filp->f_flags & O_NONBLOCK))
 	{
-		retval = wait_event_interruptible(rqueue, todo->next != todo);
+		retval = wait_event_interruptible(r->wq, ayd19m_ready(r));
 		if (retval) return retval;
 	}
 
 	retval = mutex_lock_interruptible(&rmutex);
 	if (retval) return retval;
-	if (todo->next != todo)
+	if (!r->tlen) r->tlen = ayd19m_format(r);
+	if (r->tlen)
 	{
-		data = list_entry(todo->next,struct todo_data, node);
-		n = strlen(data->data) + 1;
-		if (*f_pos < n)
+		if (*f_pos < r->tlen)
 		{
-			n -= *f_pos;
+			n = r->tlen - *f_pos;
 			if (count < n) n = count;
 
-			n -= copy_to_user(buf, data->data + *f_pos, n);
-			*f_pos = n;
-
-			if (n > strlen(data->data))
-			{
-				*f_pos = 0;
-				list_del(&data->node);
-				kfree(data);
-			}
+			n -= copy_to_user(buf, r->text + *f_pos, n);
+			*f_pos += n;
 			retval = n;
 		}
-		else
+		if (*f_pos >= r->tlen)
 		{
-			*f_pos -= n;
-			list_del(&data->node);
-			kfree(data);
-			retval = 0;
+			*f_pos = 0;
+			r->tlen = 0;
 		}
 	}
 	mutex_unlock(&rmutex);
@@ -164,32 +542,26 @@ ssize_t ayd19m_read(struct file *filp, char __user * buf, size_t count, loff_t *
 
 int ayd19m_release(struct inode *inode, struct file *filp)
 {
-	int retval = mutex_lock_interruptible(&rmutex);
-	if (!retval)
-	{
-		if (!isOpen)
-		{
-			retval = -EBADF;
-			printk(KERN_DEBUG CLASS_NAME ": bad close.\n");
-		}
-		else if (!(O_NONBLOCK & filp->f_flags))
-		{
-			struct todo_data *d;
-			struct list_head *p, *n;
-			powerOff();
-			list_for_each_safe(p, n, todo_list.next)
-			{
-				d = list_entry(p, struct todo_data, node);
-				list_del(&d->node);
-				kfree(d);
-			}
-			printk(KERN_DEBUG CLASS_NAME ": close.\n");
-		}
-		isOpen = 0;
+	struct ayd19m_reader *r = filp->private_data;
 
-		mutex_unlock(&rmutex);
+	spin_lock_irq(&readerslock);
+	list_del(&r->list);
+	spin_unlock_irq(&readerslock);
+	hrtimer_cancel(&r->wake);
+
+	mutex_lock(&rmutex);
+	if (!(O_NONBLOCK & filp->f_flags))
+	{
+		pm_runtime_put_sync(ay_d19m_Device);	// powerOff with the last file
+		printk(KERN_DEBUG CLASS_NAME ": close.\n");
 	}
-	return retval;
+	else pm_runtime_put_noidle(ay_d19m_Device);	// reader stays powered
+	isOpen--;
+	mutex_unlock(&rmutex);
+	ay_d19m_status(NULL);
+
+	kfree(r);
+	return 0;
 }
 
 /*
@@ -197,27 +569,46 @@ int ayd19m_release(struct inode *inode, struct file *filp)
  */
 int ayd19m_open(struct inode *inode, struct file *filp)
 {
+	static const struct ayd19m_filter all = AYD19M_FILTER_ALL;
+	struct ayd19m_reader *r;
 	int retval = -EACCES;
+
 	if (!(filp->f_flags & (O_WRONLY | O_RDWR)))
 	{
+		r = kzalloc(sizeof(*r), GFP_KERNEL);
+		if (!r) return -ENOMEM;
+
+		spin_lock_init(&r->lock);
+		init_waitqueue_head(&r->wq);
+		hrtimer_init(&r->wake, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		r->wake.function = ayd19m_wakeexpired;
+		r->co.records = clamp(ay_d19m_wakerec, 1U, (unsigned)AY_D19M_RING);
+		r->co.usecs = ay_d19m_wakeus;
+		r->filter = all;
+
 		retval = mutex_lock_interruptible(&rmutex);
-		if (!retval)
+		if (retval)
+		{
+			kfree(r);
+			return retval;
+		}
+		// every frame is queued to each file, in timer softirq
+		if (isOpen >= AY_D19M_FILES)
 		{
-			if (!isOpen)
-			{
-				isOpen = 1;
-				filp->private_data = &todo_list;
-				powerOn();
-				printk(KERN_DEBUG CLASS_NAME ": open.\n");
-			}
-			else
-			{
-				retval = -EBUSY;
-				printk(KERN_DEBUG CLASS_NAME ": busy.\n");
-			}
-			bitmsk = wiegandMask;
 			mutex_unlock(&rmutex);
+			kfree(r);
+			return -EBUSY;
 		}
+		isOpen++;
+		pm_runtime_get_sync(ay_d19m_Device);	// powerOn
+		mutex_unlock(&rmutex);
+
+		filp->private_data = r;
+		spin_lock_irq(&readerslock);
+		list_add_tail(&r->list, &readers);
+		spin_unlock_irq(&readerslock);
+		ay_d19m_status(NULL);
+		printk(KERN_DEBUG CLASS_NAME ": open, %d files.\n", isOpen);
 	}
 	return retval;
 }
@@ -225,12 +616,12 @@ int ayd19m_open(struct inode *inode, struct file *filp)
 static __poll_t ayd19m_poll (struct file *filp,struct  poll_table_struct *tblp)
 {
 	__poll_t res  = 0;
-	struct list_head *todo = (struct list_head *) filp->private_data;
+	struct ayd19m_reader *r = filp->private_data;
 
 	//mutex_lock_interruptible(&rmutex);
-	poll_wait(filp, &rqueue, tblp);
+	poll_wait(filp, &r->wq, tblp);
 
-	if (todo->next != todo)
+	if (ayd19m_ready(r))
 	{
 		res = POLLIN | POLLRDNORM;
 		printk(KERN_DEBUG CLASS_NAME ": poll %d.\n",res);
@@ -240,37 +631,333 @@ static __poll_t ayd19m_poll (struct file *filp,struct  poll_table_struct *tblp)
 	return res;
 }
 
+static long ayd19m_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	static const struct ayd19m_filter all = AYD19M_FILTER_ALL;
+	struct ayd19m_reader *r = filp->private_data;
+	struct ayd19m_coalesce co;
+	struct ayd19m_filter fl;
+	int wake;
+
+	switch (cmd)
+	{
+	case AYD19M_SET_COALESCE:
+		if (copy_from_user(&co, (void __user *)arg, sizeof(co))) return -EFAULT;
+		if (co.records < 1 || co.records > AY_D19M_RING) return -EINVAL;
+
+		spin_lock_irq(&r->lock);
+		r->co.records = co.records;
+		r->co.usecs = co.usecs;
+		wake = ayd19m_coalesce(r, 0);
+		spin_unlock_irq(&r->lock);
+		if (wake) wake_up(&r->wq);
+		return 0;
+
+	case AYD19M_GET_COALESCE:
+		spin_lock_irq(&r->lock);
+		co = r->co;
+		spin_unlock_irq(&r->lock);
+		return copy_to_user((void __user *)arg, &co, sizeof(co)) ? -EFAULT : 0;
+
+	case AYD19M_SET_FILTER:
+		if (copy_from_user(&fl, (void __user *)arg, sizeof(fl))) return -EFAULT;
+		if (fl.facmin > fl.facmax || fl.bitsmin > fl.bitsmax) return -EINVAL;
+
+		spin_lock_irq(&readerslock);
+		r->filter = fl;
+		r->filtered = memcmp(&fl, &all, sizeof(fl)) != 0;
+		spin_unlock_irq(&readerslock);
+		return 0;
+
+	case AYD19M_GET_FILTER:
+		spin_lock_irq(&readerslock);
+		fl = r->filter;
+		spin_unlock_irq(&readerslock);
+		return copy_to_user((void __user *)arg, &fl, sizeof(fl)) ? -EFAULT : 0;
+	}
+	return -ENOTTY;
+}
+
+/*
+ * Loopback self-test, TX D0/D1 wired to the reader D0/D1.
+ * Writing n to the ay_d19m_selftest parameter sends n Wiegand 26 frames,
+ * facility SELFTEST_FC and the sequence number as code. Reading it
+ * returns the result. Frames received while the test runs are consumed,
+ * the test ends SELFTEST_IDLE ms after the last frame sent or received.
+ */
+#define SELFTEST_FC		0xA5
+#define SELFTEST_RING	64		// frames sent but not yet received
+#define SELFTEST_MAX	0xFFFF	// the sequence number is the 16 bit code
+#define SELFTEST_IDLE	1000
+
+static struct
+{
+	spinlock_t lock;
+	int running;
+	unsigned count;		// frames to send
+	unsigned txseq;		// next frame to queue
+	unsigned sent;		// frames out on the lines
+	unsigned rxseq;		// next frame expected
+	unsigned ok, lost, err;
+	uint64_t start[SELFTEST_RING];
+	uint64_t first, last;	// first and last frame received
+	uint64_t lmin, lmax, lsum;
+	uint64_t deadline;	// ktime ns the test ends without a frame
+} selftest = { .lock = __SPIN_LOCK_UNLOCKED(selftest.lock) };
+
+// selftest.lock held
+static void selftest_alive(uint64_t now)
+{
+	selftest.deadline = now + (uint64_t)(SELFTEST_IDLE + ay_d19m_tx_gap) * NSEC_PER_MSEC;
+}
+
+// selftest.lock held, frames not back in time are lost
+static int selftest_expired(uint64_t now)
+{
+	if (!selftest.running || now < selftest.deadline) return 0;
+
+	selftest.running = 0;
+	selftest.lost += selftest.sent - selftest.rxseq;
+	printk(KERN_WARNING CLASS_NAME ": self-test timeout, %u ok, %u lost, %u errors\n", selftest.ok, selftest.lost,
+	        selftest.err);
+	return 1;
+}
+
+static uint32_t wiegand26_encode(unsigned facility, unsigned code)
+{
+	uint32_t d = (facility & 0xFF) << 17 | (code & 0xFFFF) << 1;
+
+	if (hweight32(d & 0x1FFE000) & 1) d |= 1 << 25;	// even parity bit 13..24
+	if (!(hweight32(d & 0x1FFE) & 1)) d |= 1;			// odd parity bit 1..12
+	return d;
+}
+
+void wiegand_tx_sent(uint32_t data, int bits, uint64_t start)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&selftest.lock, flags);
+	if (selftest.running)
+	{
+		selftest.start[selftest.sent++ % SELFTEST_RING] = start;
+		selftest_alive(ktime_get_ns());
+		if (selftest.txseq < selftest.count && !wiegand_tx(wiegand26_encode(SELFTEST_FC, selftest.txseq), 26))
+			selftest.txseq++;
+	}
+	spin_unlock_irqrestore(&selftest.lock, flags);
+}
+
+/*
+ * Returns 1 if the frame is consumed by the self-test.
+ */
+static int selftest_rx(uint32_t d0, uint32_t d1, int n)
+{
+	uint64_t now = ktime_get_ns(), lat;
+	unsigned long flags;
+	unsigned seq;
+	int res;
+
+	spin_lock_irqsave(&selftest.lock, flags);
+	selftest_expired(now);
+	res = selftest.running;
+	if (res)
+	{
+		selftest_alive(now);
+		seq = (d0 >> 1) & 0xFFFF;
+		if (n != 26 || (d0 ^ d1) != ~(-1 << n) || d0 != wiegand26_encode(SELFTEST_FC, seq) || seq < selftest.rxseq
+		        || seq >= selftest.sent)
+			selftest.err++;
+		else
+		{
+			selftest.lost += seq - selftest.rxseq;
+			selftest.rxseq = seq + 1;
+			if (!selftest.ok++) selftest.first = now;
+			selftest.last = now;
+			lat = now - selftest.start[seq % SELFTEST_RING];
+			selftest.lsum += lat;
+			if (lat < selftest.lmin) selftest.lmin = lat;
+			if (lat > selftest.lmax) selftest.lmax = lat;
+		}
+		if (selftest.rxseq >= selftest.count)
+		{
+			selftest.running = 0;
+			printk(KERN_INFO CLASS_NAME ": self-test done, %u ok, %u lost, %u errors\n", selftest.ok, selftest.lost,
+			        selftest.err);
+		}
+	}
+	spin_unlock_irqrestore(&selftest.lock, flags);
+	return res;
+}
+
+static int selftest_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned long flags;
+	unsigned n;
+	int res = kstrtouint(val, 0, &n);
+
+	if (res) return res;
+	if (ay_d19m_tx_d0 < 0) return -ENODEV;
+	n = min(n, (unsigned)SELFTEST_MAX);
+
+	spin_lock_irqsave(&selftest.lock, flags);
+	// frames of the last run still on the lines would be counted in this one
+	if (n && (selftest.running || wiegand_tx_busy()))
+	{
+		spin_unlock_irqrestore(&selftest.lock, flags);
+		return -EBUSY;
+	}
+	memset(&selftest.count, 0, sizeof(selftest) - offsetof(typeof(selftest), count));
+	selftest.lmin = ~0ULL;
+	selftest.count = n;
+	selftest.running = n > 0;
+	selftest_alive(ktime_get_ns());
+	while (selftest.txseq < n && selftest.txseq < WIEGAND_TXQ
+	        && !wiegand_tx(wiegand26_encode(SELFTEST_FC, selftest.txseq), 26))
+		selftest.txseq++;
+	spin_unlock_irqrestore(&selftest.lock, flags);
+
+	printk(KERN_INFO CLASS_NAME ": self-test %u frames\n", n);
+	return 0;
+}
+
+static int selftest_get(char *buffer, const struct kernel_param *kp)
+{
+	unsigned long flags;
+	uint64_t rate = 0, lavg = 0, lmin = 0;
+	int s;
+
+	spin_lock_irqsave(&selftest.lock, flags);
+	selftest_expired(ktime_get_ns());
+	if (selftest.ok > 1 && selftest.last > selftest.first)
+		rate = div64_u64((uint64_t)(selftest.ok - 1) * 100 * NSEC_PER_SEC, selftest.last - selftest.first);
+	if (selftest.ok)
+	{
+		lavg = div64_u64(selftest.lsum, selftest.ok);
+		lmin = selftest.lmin;
+	}
+	s = scnprintf(buffer, PAGE_SIZE, "%s sent=%u ok=%u lost=%u err=%u rate=%llu.%02llu/s latency=%llu/%llu/%llu us\n",
+	        selftest.running ? "running" : "idle", selftest.sent, selftest.ok, selftest.lost, selftest.err, rate / 100,
+	        rate % 100, lmin / NSEC_PER_USEC, lavg / NSEC_PER_USEC, selftest.lmax / NSEC_PER_USEC);
+	spin_unlock_irqrestore(&selftest.lock, flags);
+	return s;
+}
+
+static const struct kernel_param_ops selftest_ops = {
+	.set = selftest_set,
+	.get = selftest_get,
+};
+module_param_cb(ay_d19m_selftest, &selftest_ops, NULL, 0644);
+MODULE_PARM_DESC(ay_d19m_selftest, CLASS_NAME " Write n to send n loopback frames on TX, read for the result");
+
+static int capture_get(char *buffer, const struct kernel_param *kp)
+{
+	uint64_t up = ktime_get_ns() - pollst.load;
+
+	return scnprintf(buffer, PAGE_SIZE, "irq: %llu ms, %u edges, %llu us in handler\npoll: %llu ms, %u frames, %u samples\n"
+	        "log: %u edges, %u lost\n",
+	        (up - pollst.pollns) / NSEC_PER_MSEC, atomic_read(&pollst.irqs), (u64)atomic64_read(&pollst.irqns) / NSEC_PER_USEC,
+	        pollst.pollns / NSEC_PER_MSEC, atomic_read(&pollst.windows), atomic_read(&pollst.ticks), atomic_read(&wlog.head), READ_ONCE(wlog.lost));
+}
+
+static const struct kernel_param_ops capture_ops = {
+	.get = capture_get,
+};
+module_param_cb(ay_d19m_capture, &capture_ops, NULL, 0444);
+MODULE_PARM_DESC(ay_d19m_capture, CLASS_NAME " Time in IRQ and polling capture mode, with ay_d19m_poll");
+
 struct file_operations ayd19m_fops = {
 	.owner = THIS_MODULE,
 //  .llseek = ayd19m_llseek,
     .read = ayd19m_read,
 //  .write = ayd19m_write,
     .poll = ayd19m_poll,
-// .unlocked_ioctl = ayd19m_ioctl,
+    .unlocked_ioctl = ayd19m_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,	// the ioctl structs are __u32 only, same layout
+#else
+    .compat_ioctl = ayd19m_ioctl,
+#endif
     .open = ayd19m_open,
 
     .release = ayd19m_release, };
 
-void ayd19m_cleanup_module(void)
+static int ayd19m_suspend(struct device *dev)
+{
+	if (ay_d19m_wakeup && device_may_wakeup(dev))
+	{
+		pmstat.suspended = 1;
+		WRITE_ONCE(pmstat.asleep, 1);
+		// an open poll window would keep D0/D1 masked through suspend
+		hrtimer_cancel(&pollst.timer);
+		if (atomic_xchg(&pollst.active, 0))
+		{
+			enable_irq(irqlineD0);
+			enable_irq(irqlineD1);
+		}
+		pmstat.irqwake = (enable_irq_wake(irqlineD0) ? 0 : 1) | (enable_irq_wake(irqlineD1) ? 0 : 2);
+		if (pmstat.irqwake != 3)
+			printk(KERN_WARNING CLASS_NAME ": D0/D1 IRQ can not wake the system\n");
+		ay_d19m_status(NULL);
+		return 0;
+	}
+	return pm_runtime_force_suspend(dev);
+}
+
+static int ayd19m_resume(struct device *dev)
+{
+	if (ay_d19m_wakeup && device_may_wakeup(dev))
+	{
+		if (pmstat.irqwake & 1) disable_irq_wake(irqlineD0);
+		if (pmstat.irqwake & 2) disable_irq_wake(irqlineD1);
+		pmstat.irqwake = 0;
+		pmstat.suspended = 0;
+		pmstat.resumets = ktime_get_ns();
+		WRITE_ONCE(pmstat.asleep, 0);
+		ay_d19m_status(NULL);
+		return 0;
+	}
+	return pm_runtime_force_resume(dev);
+}
+
+static int ayd19m_runtime_suspend(struct device *dev)
 {
-	struct todo_data *d;
-	struct list_head *p, *n;
+	powerOff();
+	WRITE_ONCE(powered, 0);
+	ay_d19m_status(NULL);
+	return 0;
+}
+
+static int ayd19m_runtime_resume(struct device *dev)
+{
+	powerOn();
+	WRITE_ONCE(powered, 1);
+	ay_d19m_status(NULL);
+	return 0;
+}
 
+static const struct dev_pm_ops ayd19m_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(ayd19m_suspend, ayd19m_resume)
+	SET_RUNTIME_PM_OPS(ayd19m_runtime_suspend, ayd19m_runtime_resume, NULL)
+};
+
+void ayd19m_cleanup_module(void)
+{
 	del_timer(&wiegand_timeout);
+	hrtimer_cancel(&pollst.timer);
+	del_timer_sync(&corr.timer);
 
+	wiegand_tx_exit();
 	releaseGPIO();
+	ay_d19m_traceexit();
+	sysfs_remove_bin_file(&ay_d19m_Device->kobj, &ay_d19m_statusattr);
 
-	list_for_each_safe(p, n, todo_list.next)
-	{
-		d = list_entry(p, struct todo_data, node);
-		list_del(&d->node);
-		kfree(d);
-	}
-
+	pm_runtime_disable(ay_d19m_Device);
+	device_init_wakeup(ay_d19m_Device, false);
 	device_destroy(ay_d19m_Class, MKDEV(ayd19m_major, 0));	// remove the device
 	class_unregister(ay_d19m_Class);                        // unregister the device class
 	class_destroy(ay_d19m_Class);                           // remove the device class 9rS8s5M2x9nCxjK
 	unregister_chrdev(ayd19m_major, DEVICE_NAME);           // unregister the major number
+	free_page((unsigned long)status);						// mappings left keep their reference
 	printk(KERN_INFO CLASS_NAME ": cleanup success\n");
 }
 
@@ -287,11 +974,30 @@ int ayd19m_init_module(void)
 
 	printk(KERN_INFO CLASS_NAME ": Initializing mode %d on %d HZ System...\n", ay_d19m_mode, HZ);
 	mutex_init(&rmutex);
-	INIT_LIST_HEAD(&todo_list);
-	init_waitqueue_head(&rqueue);
-	timer_setup(&wiegand_timeout, wiegand_timeoutfunc, 0);
+
+	if (ay_d19m_cpu >= 0 && (ay_d19m_cpu >= nr_cpu_ids || !cpu_online(ay_d19m_cpu)))
+	{
+		printk(KERN_WARNING CLASS_NAME ": CPU %d not online, IRQ affinity unchanged\n", ay_d19m_cpu);
+		ay_d19m_cpu = -1;
+	}
+	if (ay_d19m_poll && ay_d19m_poll < AY_D19M_POLLMIN)
+	{
+		printk(KERN_WARNING CLASS_NAME ": poll offset %u us raised to %u us\n", ay_d19m_poll, AY_D19M_POLLMIN);
+		ay_d19m_poll = AY_D19M_POLLMIN;
+	}
+	// pinned, the timer runs on the CPU of the IRQ that armed it
+	timer_setup(&wiegand_timeout, wiegand_timeoutfunc, ay_d19m_cpu >= 0 ? TIMER_PINNED : 0);
+	timer_setup(&corr.timer, ayd19m_pintimeout, 0);
+	hrtimer_init(&pollst.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pollst.timer.function = ay_d19m_polltick;
+	pollst.load = ktime_get_ns();
+	status = (struct ayd19m_status *)get_zeroed_page(GFP_KERNEL);
+	if (!status) return -ENOMEM;
+	status->size = sizeof(*status);
 
 	result = acquiresGPIO();
+	if (!result)
+		result = wiegand_tx_init(ay_d19m_tx_d0, ay_d19m_tx_d1, ay_d19m_tx_pulse, ay_d19m_tx_interval, ay_d19m_tx_gap);
 	if (!result)
 	{
 		// Try to dynamically allocate a major number for the device -- more difficult but worth it
@@ -313,6 +1019,7 @@ int ayd19m_init_module(void)
 
 				printk(KERN_INFO CLASS_NAME ": device class registered correctly\n");
 				ay_d19m_Class->dev_uevent = ayd19m_uevent;
+				ay_d19m_Class->pm = &ayd19m_pm_ops;
 				// Register the device driver
 				ay_d19m_Device = device_create(ay_d19m_Class, NULL, MKDEV(ayd19m_major, ayd19m_minor), NULL, DEVICE_NAME);
 				if (IS_ERR(ay_d19m_Device))               // Clean up if there is an error
@@ -322,92 +1029,661 @@ int ayd19m_init_module(void)
 					printk(KERN_ERR CLASS_NAME ":Failed to create the device\n");
 					result = PTR_ERR(ay_d19m_Device);
 				}
-				else printk(KERN_INFO CLASS_NAME ": device created correctly\n"); // Made it! device was initialized
+				else
+				{
+					printk(KERN_INFO CLASS_NAME ": device created correctly\n"); // Made it! device was initialized
+					device_init_wakeup(ay_d19m_Device, ay_d19m_wakeup);
+					pm_runtime_enable(ay_d19m_Device);		// suspended, reader power off
+					ay_d19m_traceinit();
+					if (sysfs_create_bin_file(&ay_d19m_Device->kobj, &ay_d19m_statusattr))
+						printk(KERN_WARNING CLASS_NAME ": no status page\n");
+					ay_d19m_status(NULL);
+				}
 			}
 		}
 		else
 			printk(KERN_ERR CLASS_NAME " failed to register a major number\n");
 	}
-	if (result) releaseGPIO();
+	if (result)
+	{
+		wiegand_tx_exit();
+		releaseGPIO();
+		free_page((unsigned long)status);
+		status = NULL;
+	}
 	return result;
 }
 
+#ifdef CONFIG_RELAY
+static struct dentry *ay_d19m_tracefile(const char *filename, struct dentry *parent, umode_t mode,
+		struct rchan_buf *buf, int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int ay_d19m_traceremove(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+// flight recorder, a full channel overwrites the oldest sub-buffer
+static int ay_d19m_tracesub(struct rchan_buf *buf, void *subbuf, void *prev_subbuf, size_t prev_padding)
+{
+	return 1;
+}
+
+static struct rchan_callbacks ay_d19m_tracecb = {
+	.subbuf_start = ay_d19m_tracesub,
+	.create_buf_file = ay_d19m_tracefile,
+	.remove_buf_file = ay_d19m_traceremove,
+};
+#endif
+
+static void ay_d19m_traceinit(void)
+{
+#ifdef CONFIG_RELAY
+	etrace.dir = debugfs_create_dir(DEVICE_NAME, NULL);
+	if (IS_ERR_OR_NULL(etrace.dir))
+	{
+		etrace.dir = NULL;
+		return;
+	}
+	// the last AY_D19M_TRACEBUFS * AY_D19M_TRACESUB bytes per CPU are kept
+	etrace.chan = relay_open("trace", etrace.dir, AY_D19M_TRACESUB, AY_D19M_TRACEBUFS, &ay_d19m_tracecb, NULL);
+	if (!etrace.chan)
+	{
+		printk(KERN_WARNING CLASS_NAME ": no edge trace, relay_open failed\n");
+		debugfs_remove_recursive(etrace.dir);
+		etrace.dir = NULL;
+	}
+#endif
+}
+
+static void ay_d19m_traceexit(void)
+{
+#ifdef CONFIG_RELAY
+	if (etrace.chan) relay_close(etrace.chan);
+	debugfs_remove_recursive(etrace.dir);
+	etrace.chan = NULL;
+	etrace.dir = NULL;
+#endif
+}
+
+static void ay_d19m_tracerec(int type, unsigned seq, int line, int level, uint64_t ts)
+{
+#ifdef CONFIG_RELAY
+	ayd19m_trace_t t;
+
+	if (!ay_d19m_trace || !etrace.chan) return;
+
+	t.ts = ts;
+	t.seq = seq;
+	t.type = type;
+	t.line = line;
+	t.level = level;
+	t.mode = ay_d19m_mode;
+	relay_write(etrace.chan, &t, sizeof(t));
+#endif
+}
+
+/*
+ * First edge of a frame, hold off system suspend until it is complete.
+ */
+static void ay_d19m_framestart(uint64_t ts)
+{
+	if (!ay_d19m_wakeup) return;
+
+	pm_stay_awake(ay_d19m_Device);
+	if (READ_ONCE(pmstat.suspended))
+	{
+		pmstat.suspended = 0;
+		pmstat.wakeframe = 1;
+		pmstat.wakets = ts;
+		pm_wakeup_hard_event(ay_d19m_Device);	// aborts or ends the suspend
+	}
+}
+
+static void ay_d19m_framedone(void)
+{
+	if (!ay_d19m_wakeup) return;
+
+	if (pmstat.wakeframe)
+	{
+		pmstat.wakeframe = 0;
+		pmstat.wakeups++;
+		pmstat.lat = ktime_get_ns() - pmstat.wakets;
+		if (pmstat.lat > pmstat.latmax) pmstat.latmax = pmstat.lat;
+		// the frame timeout runs from the waking edge, resume overlaps it
+		printk(KERN_INFO CLASS_NAME ": wakeup edge to resume %llu us, to frame captured %llu us\n",
+		        pmstat.resumets > pmstat.wakets ? (pmstat.resumets - pmstat.wakets) / NSEC_PER_USEC : 0,
+		        pmstat.lat / NSEC_PER_USEC);
+		ay_d19m_status(NULL);
+	}
+	pm_relax(ay_d19m_Device);
+}
+
+static void wiegand_open(uint64_t ts)
+{
+	ay_d19m_framestart(ts);
+	mod_timer(&wiegand_timeout, jiffies + HZ / 25); // 40ms
+}
+
+static void wiegand_edge(int line, unsigned lines, uint64_t ts)
+{
+	typeof(wlog.ring[0]) *slot;
+	unsigned pos;
+
+	pos = atomic_inc_return(&wlog.head) - 1;
+	ay_d19m_tracerec(AYD19M_TRACE_EDGE, pos, line, lines, ts);
+	slot = &wlog.ring[pos % AY_D19M_EDGES];
+
+	// a writer lapping the reader: the old seq must not stay valid over the new edge
+	WRITE_ONCE(slot->seq, 0);
+	smp_wmb();
+	slot->e.ts = ts;
+	slot->e.line = line;
+	slot->e.level = lines;
+	smp_store_release(&slot->seq, pos + 1);
+
+	// the first edge of a frame arms the frame timer
+	if (!atomic_cmpxchg(&wlog.open, 0, 1))
+		wiegand_open(ts);
+}
+
+static void ay_d19m_edge(int line, int level)
+{
+	uint64_t ts = ktime_get_mono_fast_ns();	// also while timekeeping is suspended
+
+	spin_lock(&edgelock);
+	if (!edgecnt) ay_d19m_framestart(ts);
+	// level unchanged, the IRQ was late and two edges collapsed to one
+	if (level == edgelevel[line] && edgecnt < AY_D19M_EDGES)
+	{
+		edgelog[edgecnt].ts = ts;
+		edgelog[edgecnt].line = line;
+		edgelog[edgecnt++].level = !level;
+		ay_d19m_tracerec(AYD19M_TRACE_EDGE, atomic_inc_return(&etrace.seq) - 1, line, !level, ts);
+	}
+	if (edgecnt < AY_D19M_EDGES)
+	{
+		edgelog[edgecnt].ts = ts;
+		edgelog[edgecnt].line = line;
+		edgelog[edgecnt++].level = level;
+		ay_d19m_tracerec(AYD19M_TRACE_EDGE, atomic_inc_return(&etrace.seq) - 1, line, level, ts);
+	}
+	edgelevel[line] = level;
+	spin_unlock(&edgelock);
+
+	mod_timer(&wiegand_timeout, jiffies + msecs_to_jiffies(AY_D19M_QUIET) + 1);
+}
+
+/*
+ * On PREEMPT_RT (or threadirqs) the handler runs in the IRQ thread, the
+ * priority is set from inside the thread as there is no other handle to it.
+ */
+static void ay_d19m_irqthread(int line)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+	struct sched_param param = { .sched_priority = ay_d19m_prio };
+#else
+	// sched_set_fifo() has no priority argument, it is always 50
+	struct sched_attr param = { .size = sizeof(param), .sched_policy = SCHED_FIFO, .sched_priority = ay_d19m_prio };
+#endif
+
+	if (in_irq() || irqprio[line] == ay_d19m_prio || ay_d19m_prio < 1 || ay_d19m_prio >= MAX_RT_PRIO)
+		return;
+
+	irqprio[line] = ay_d19m_prio;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+	sched_setscheduler_nocheck(current, SCHED_FIFO, &param);
+#else
+	sched_setattr_nocheck(current, &param);
+#endif
+	printk(KERN_INFO CLASS_NAME ": D%d IRQ thread SCHED_FIFO priority %d\n", line, param.sched_priority);
+}
+
+/*
+ * D0 level in bit 0, D1 in bit 1. With ay_d19m_batch both lines come from
+ * one snapshot, gpiolib reads each GPIO chip once (get_multiple), so D0/D1
+ * on the same bank cost a single register read.
+ */
+static unsigned ay_d19m_sample(void)
+{
+	if (batchdesc[0])
+	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+		unsigned long v = 0;
+
+		gpiod_get_raw_array_value(2, batchdesc, NULL, &v);
+		return v & 3;
+#else
+		int v[2] = { 0, 0 };
+
+		gpiod_get_raw_array_value(2, batchdesc, v);
+		return (v[0] ? 1 : 0) | (v[1] ? 2 : 0);
+#endif
+	}
+	return (gpio_get_value(ay_d19m_d0) ? 1 : 0) | (gpio_get_value(ay_d19m_d1) ? 2 : 0);
+}
+
+static enum hrtimer_restart ay_d19m_polltick(struct hrtimer *timer)
+{
+	uint64_t now = ktime_get_ns();
+	unsigned lines = ay_d19m_sample();
+
+	atomic_inc(&pollst.ticks);
+
+	// not open, the frame timer has closed the frame
+	if (lines != 3 && atomic_read(&wlog.open))
+	{
+		// D0 low is a 0 bit, D1 low a 1 bit, both low stays a bit error
+		wiegand_edge(lines == 1, lines, now - ay_d19m_poll * NSEC_PER_USEC);
+		hrtimer_forward_now(timer, ns_to_ktime(pollst.bit));
+		return HRTIMER_RESTART;
+	}
+	// no pulse, the frame is over or the phase lost, the next edge is an IRQ
+	pollst.pollns += now - pollst.since;
+	pollst.rearm = now;
+	atomic_set(&pollst.active, 0);
+	enable_irq(irqlineD0);
+	enable_irq(irqlineD1);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Edge by IRQ in poll mode, opened if it started the frame. The second
+ * edge locks the sample timer to the bit interval, one CPU claims it.
+ */
+static void ay_d19m_polllock(int opened, uint64_t ts)
+{
+	uint64_t first = atomic64_xchg(&pollst.first, opened ? ts : 0);
+	uint64_t bit = ts - first;
+
+	if (opened || !first) return;
+	if (bit < 2 * ay_d19m_poll * NSEC_PER_USEC || bit > AY_D19M_POLLBIT * NSEC_PER_USEC) return;
+	if (atomic_cmpxchg(&pollst.active, 0, 1)) return;
+
+	disable_irq_nosync(irqlineD0);
+	disable_irq_nosync(irqlineD1);
+	atomic_inc(&pollst.windows);
+	pollst.bit = bit;
+	pollst.since = ts;
+	hrtimer_start(&pollst.timer, ns_to_ktime(ts + bit + ay_d19m_poll * NSEC_PER_USEC), HRTIMER_MODE_ABS);
+}
+
 static irqreturn_t ay_d19m_irqdata(int irq, void *dev)
 {
-	if (bitmsk == wiegandMask)
+	int line = irq == irqlineD1;
+	unsigned lines;
+	uint64_t now = 0, ts;
+	int opened;
+
+	ay_d19m_irqthread(line);
+
+	// no hrtimer in suspend, every edge is an IRQ until resume
+	if (ay_d19m_poll && !sk3x4mx && !READ_ONCE(pmstat.asleep))
 	{
-		data1 = gpio_get_value(ay_d19m_d1) ? bitmsk : 0;
-		data0 = gpio_get_value(ay_d19m_d0) ? bitmsk : 0;
+		now = ktime_get_ns();
+		// the other line's edge racing the claim, the timer samples it
+		if (atomic_read(&pollst.active)) return IRQ_HANDLED;
+		/*
+		 * An edge latched while the IRQ was masked is replayed by enable_irq,
+		 * its pulse is over. A line still low is the first bit of a new frame.
+		 */
+		if (now - pollst.rearm < AY_D19M_POLLREPLAY * NSEC_PER_USEC && ay_d19m_sample() == 3)
+			return IRQ_HANDLED;
+	}
 
-		mod_timer(&wiegand_timeout, jiffies + HZ / 25); // 40ms
+	if (sk3x4mx)
+	{
+		if (batchdesc[0]) lines = ay_d19m_sample();
+		else lines = (gpio_get_value(line ? ay_d19m_d1 : ay_d19m_d0) ? 1 : 0) << line;
+		ay_d19m_edge(line, (lines >> line) & 1);
+		return IRQ_HANDLED;
 	}
-	else
+
+	lines = ay_d19m_sample();
+	ts = ktime_get_mono_fast_ns();	// also while timekeeping is suspended
+	opened = !atomic_read(&wlog.open);
+	wiegand_edge(line, lines, ts);
+	if (now)
 	{
-		data1 |= gpio_get_value(ay_d19m_d1) ? bitmsk : 0;
-		data0 |= gpio_get_value(ay_d19m_d0) ? bitmsk : 0;
+		atomic_inc(&pollst.irqs);
+		ay_d19m_polllock(opened, ts);
+		atomic64_add(ktime_get_ns() - now, &pollst.irqns);
 	}
-	bitmsk >>= 1;
 	return IRQ_HANDLED;
 }
 
-static void wiegand_timeoutfunc(struct timer_list *timer)
+static int ayd19m_match(const struct ayd19m_filter *fl, int res, int cls, unsigned facility, int bits)
+{
+	// facility UINT_MAX, the record has no facility code
+	return (unsigned)res < 32 && (fl->results & (1U << res)) && (fl->classes & cls)
+	        && (facility == UINT_MAX || (facility >= fl->facmin && facility <= fl->facmax))
+	        && bits >= fl->bitsmin && bits <= fl->bitsmax;
+}
+
+/*
+ * Frame completion, only the raw frame is stored here, in each reader
+ * whose filter it passes.
+ */
+static void ayd19m_queue(fmt f, uint32_t code, int bits, uint64_t start, const char *pin, unsigned repeat)
+{
+	struct ayd19m_reader *r;
+	struct ayd19m_frame fr = { 0 };
+	struct ayd19m_dup *dup = NULL;
+	uint64_t now = ktime_get_ns();
+	unsigned long flags;
+	unsigned i, h = 0, facility = UINT_MAX;
+	int wake, key, res = -1, cls = 0;
+
+	spin_lock_irqsave(&readerslock, flags);
+	// only card frames repeat, never keys or a PIN re-entered (modes 4..6, P=)
+	if (ay_d19m_dupwin && (f == fmt_wiegand26 || (f == fmt_nosupport && bits > 8)) && !pin)
+	{
+		h = hash_32(code ^ bits, AY_D19M_DUPHASH);
+		dup = &duptab[h];
+		if (dup->code == code && dup->bits == bits && now - dup->ts < (uint64_t)ay_d19m_dupwin * NSEC_PER_MSEC)
+		{
+			dup->ts = now;
+			dupdrop++;
+			list_for_each_entry(r, &readers, list)
+			{
+				// the copy is still queued if its slot is unread and not reused
+				spin_lock(&r->lock);
+				i = r->dupslot[h];
+				if (i - r->head < r->tail - r->head && r->ring[i % AY_D19M_RING].seq == dup->seq)
+					r->ring[i % AY_D19M_RING].repeat++;
+				spin_unlock(&r->lock);
+			}
+			spin_unlock_irqrestore(&readerslock, flags);
+			ay_d19m_status(NULL);
+			return;
+		}
+		dup->code = code;
+		dup->bits = bits;
+		dup->ts = now;
+		dup->seq = fseq + 1;
+	}
+	fseq++;
+
+	fr.f = f;
+	fr.code = code;
+	fr.bits = bits;
+	fr.mode = ay_d19m_mode;		// M= as captured, the mode may change before read
+	fr.start = start;
+	fr.ts = now;
+	fr.seq = fseq;
+	fr.repeat = repeat;		// collapsed while the card was held
+	fr.haspin = pin != NULL;
+	if (pin) strscpy(fr.pin, pin, sizeof(fr.pin));
+
+	list_for_each_entry(r, &readers, list)
+	{
+		if (r->filtered)
+		{
+			// classified once, only if a reader filters
+			if (res < 0)
+			{
+				res = fmt_result(f, code, bits, &facility);
+				key = fmt_key(f, code);
+				if (key) cls = AYD19M_CLASS_KEY;
+				else if (f == fmt_wiegand26) cls = pin ? AYD19M_CLASS_CARD | AYD19M_CLASS_PIN : AYD19M_CLASS_CARD;
+				else if (f == fmt_nosupport) cls = AYD19M_CLASS_OTHER;
+				else cls = AYD19M_CLASS_PIN;
+			}
+			if (!ayd19m_match(&r->filter, res, cls, facility, bits)) continue;
+		}
+
+		spin_lock(&r->lock);
+		if (r->tail - r->head < AY_D19M_RING)
+		{
+			if (dup) r->dupslot[h] = r->tail;
+			r->ring[r->tail++ % AY_D19M_RING] = fr;
+		}
+		else
+		{
+			r->overrun++;
+			overruns++;
+		}
+		wake = ayd19m_coalesce(r, r->tail - r->head >= AY_D19M_RING);
+		spin_unlock(&r->lock);
+
+		if (wake) wake_up(&r->wq);
+	}
+	spin_unlock_irqrestore(&readerslock, flags);
+	ay_d19m_status(&fr);
+}
+
+// card and keys held are queued as read, corr.lock held
+static void ayd19m_unhold(void)
 {
-	int s, n = 32;
-	while(bitmsk)
+	int i;
+
+	if (!corr.held) return;
+
+	ayd19m_queue(corr.card.f, corr.card.code, corr.card.bits, corr.card.start, NULL, corr.repeat);
+	for (i = 0; i < corr.nkeys; i++)
+		ayd19m_queue(corr.key[i].f, corr.key[i].code, corr.key[i].bits, corr.key[i].start, NULL, 0);
+	corr.held = 0;
+	corr.nkeys = 0;
+}
+
+static void ayd19m_pintimeout(struct timer_list *timer)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&corr.lock, flags);
+	// fired for a card released meanwhile, a new card holds its own window
+	if (corr.held && time_before(jiffies, corr.deadline))
 	{
-		n--;
-		bitmsk >>= 1;
+		spin_unlock_irqrestore(&corr.lock, flags);
+		return;
 	}
-	data0 >>= (32-n);
-	data1 >>= (32-n);
+	ayd19m_unhold();
+	spin_unlock_irqrestore(&corr.lock, flags);
+}
 
-	printk(KERN_DEBUG CLASS_NAME ": wiegand mode %d, D0 %8.8X, D1 %8.8X, D0 xor D1 %8.8X, bits %d\n", ay_d19m_mode, data0, data1,
-	        data0 ^ data1, n);
+/*
+ * Decoded frame to the reader, through the card + PIN correlation.
+ */
+static void ayd19m_correlate(fmt f, uint32_t code, int bits, uint64_t start)
+{
+	unsigned long flags;
+	int key, n;
 
-	if((data0 ^ data1) == ~(-1 << n))
+	if (!ay_d19m_pinwin || !(ay_d19m_mode == SKW06RF || ay_d19m_mode == SKW06NP || ay_d19m_mode == SKW08NC
+	        || ay_d19m_mode == SK3X4MX))
 	{
-		char rbuffer[MAX_READSZ];
+		ayd19m_queue(f, code, bits, start, NULL, 0);
+		return;
+	}
 
-		if(n == wiegandLength[ay_d19m_mode]+1)
-			s = ffmt[ay_d19m_mode](data0, n, rbuffer, sizeof(rbuffer) - 2);
-		else if(n == 26)
-			s = ffmt[WIEGAND26](data0, n, rbuffer, sizeof(rbuffer) - 2);
+	key = fmt_key(f, code);
+	spin_lock_irqsave(&corr.lock, flags);
+	if (f == fmt_wiegand26 && corr.held && corr.card.code == code && corr.card.bits == bits
+	        && start - corr.last < (uint64_t)ay_d19m_dupwin * NSEC_PER_MSEC)
+	{
+		// the held card repeated, PIN typed and PIN window stay
+		corr.repeat++;
+		corr.last = start;
+	}
+	else if (f == fmt_wiegand26)
+	{
+		ayd19m_unhold();		// the card before got no PIN
+		corr.held = 1;
+		corr.card.f = f;
+		corr.card.code = code;
+		corr.card.bits = bits;
+		corr.card.start = start;
+		corr.repeat = 0;
+		corr.last = start;
+		corr.pin[0] = 0;
+		corr.deadline = jiffies + msecs_to_jiffies(ay_d19m_pinwin);
+		mod_timer(&corr.timer, corr.deadline);
+	}
+	else if (corr.held && key == '#')
+	{
+		del_timer(&corr.timer);
+		corr.pairs++;
+		ayd19m_queue(corr.card.f, corr.card.code, corr.card.bits, corr.card.start, corr.pin, corr.repeat);
+		corr.held = 0;
+		corr.nkeys = 0;
+	}
+	else if (corr.held && key > 0 && corr.nkeys < AY_D19M_PINMAX)
+	{
+		corr.key[corr.nkeys].f = f;
+		corr.key[corr.nkeys].code = code;
+		corr.key[corr.nkeys].bits = bits;
+		corr.key[corr.nkeys++].start = start;
+		n = strlen(corr.pin);
+		if (key == '*') corr.pin[0] = 0;
 		else
-			s = snprintf(rbuffer, sizeof(rbuffer) - 2, "R=%d, M=%d, D=%8.8X, L=%d", RES_NOSUPORT, ay_d19m_mode, data0, n);
-
-		if (s)
 		{
-			struct todo_data *data = kmalloc(sizeof(struct todo_data), GFP_KERNEL);
-			printk(KERN_INFO CLASS_NAME ": new key on mode %d, code %s\n", ay_d19m_mode, rbuffer);
+			corr.pin[n++] = key;
+			corr.pin[n] = 0;
+		}
+	}
+	else
+	{
+		ayd19m_unhold();
+		ayd19m_queue(f, code, bits, start, NULL, 0);
+	}
+	spin_unlock_irqrestore(&corr.lock, flags);
+}
 
-			rbuffer[s++] = '\n';
-			rbuffer[s++] = '\0';
+static void wiegand_frame(uint32_t d0, uint32_t d1, int n, uint64_t start)
+{
+	printk(KERN_DEBUG CLASS_NAME ": wiegand mode %d, D0 %8.8X, D1 %8.8X, D0 xor D1 %8.8X, bits %d\n", ay_d19m_mode, d0, d1,
+	        d0 ^ d1, n);
 
-			if (data)
-			{
-				mutex_lock(&rmutex);
-				del_timer(&wiegand_timeout);
-				strncpy(data->data, rbuffer, s);
-				list_add_tail(&data->node, &todo_list);
-				mutex_unlock(&rmutex);
+	if (selftest_rx(d0, d1, n)) return;
 
-				wake_up(&rqueue);
-			}
-		}
+	if((d0 ^ d1) == ~(-1 << n))
+	{
+		if (ay_d19m_tx_pass) wiegand_tx(d0, n);
+
+		ayd19m_correlate(wiegand_fmt(ay_d19m_mode, n), d0, n, start);
 	}
 	else
+	{
 		printk(KERN_WARNING CLASS_NAME ": Mode %d, bit-error! D0 %8.8X xor D1 %8.8X = %8.8X expected %8.8X\n", ay_d19m_mode,
-				        data0, data1, data0 ^ data1, ~(-1 << n));
+				        d0, d1, d0 ^ d1, ~(-1 << n));
+		biterrs++;
+		ay_d19m_status(NULL);
+	}
+}
 
-	data0 = data1 = 0;
-	bitmsk = wiegandMask;
+/*
+ * SK3X4MX capture window closed. D0 edges while D1 is low belong to the
+ * UART character of a key, short pulses on D0/D1 are Wiegand card bits.
+ */
+static void sk3x4mx_timeout(void)
+{
+	static ayd19m_edge_t e[AY_D19M_EDGES];
+	ayd19m_wiegand_t w = { 0 };
+	uint32_t code[4];
+	uint64_t down;
+	unsigned long flags;
+	int i, j, k, n;
+
+	spin_lock_irqsave(&edgelock, flags);
+	n = edgecnt;
+	memcpy(e, edgelog, n * sizeof(*e));
+	edgecnt = 0;
+	ay_d19m_tracerec(AYD19M_TRACE_FRAME, atomic_read(&etrace.seq), 0, 0, ktime_get_ns());
+	spin_unlock_irqrestore(&edgelock, flags);
+
+	for (i = 0; i < n; i++)
+	{
+		down = sk3x4mx_edge(&skstate, &w, &e[i]);
+		if (down)
+		{
+			k = sk3x4mx_keys(&skstate, down, code, ARRAY_SIZE(code));
+			for (j = 0; j < k; j++)
+				ayd19m_correlate(fmt_SK3X4MX, code[j], 8, skstate.down);
+		}
+	}
+	if (w.bits) wiegand_frame(w.d0, w.d1, w.bits, w.start);
+	ay_d19m_framedone();
+}
 
+static void wiegand_timeoutfunc(struct timer_list *timer)
+{
+	typeof(wlog.ring[0]) *slot;
+	ayd19m_wiegand_t w = { 0 };
+	ayd19m_edge_t e;
+	unsigned head, seq;
+	int spin;
+
+	if (sk3x4mx)
+	{
+		sk3x4mx_timeout();
+		return;
+	}
+
+	head = atomic_read(&wlog.head);
+	if (head - wlog.tail > AY_D19M_EDGES)
+	{
+		wlog.lost += head - wlog.tail - AY_D19M_EDGES;
+		wlog.tail = head - AY_D19M_EDGES;
+	}
+	for (; wlog.tail != head; wlog.tail++)
+	{
+		slot = &wlog.ring[wlog.tail % AY_D19M_EDGES];
+		// reserved but not yet written, the writer is on another CPU
+		for (spin = 0; (int)((seq = smp_load_acquire(&slot->seq)) - (wlog.tail + 1)) < 0 && spin < 1000; spin++)
+			cpu_relax();
+		if (seq != wlog.tail + 1)
+		{
+			if ((int)(seq - (wlog.tail + 1)) < 0) break;	// left for the next frame
+			wlog.lost++;
+			continue;
+		}
+		e = slot->e;
+		smp_rmb();
+		if (READ_ONCE(slot->seq) != seq)
+		{
+			wlog.lost++;
+			continue;
+		}
+
+		wiegand_sample(&w, &e);
+	}
+	ay_d19m_tracerec(AYD19M_TRACE_FRAME, wlog.tail, 0, 0, ktime_get_ns());
+
+	if (w.bits) wiegand_frame(w.d0, w.d1, w.bits, w.start);
+	ay_d19m_framedone();
+
+	atomic_set(&wlog.open, 0);
+	smp_mb__after_atomic();
+	// edges that raced with the close start the next frame
+	if (atomic_read(&wlog.head) != wlog.tail && !atomic_cmpxchg(&wlog.open, 0, 1))
+		wiegand_open(ktime_get_ns());
+}
+
+// irq_set_affinity_hint() is deprecated since 5.17, NULL drops the hint only
+static void ay_d19m_affinity(unsigned irq, const struct cpumask *mask)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	if (mask) irq_set_affinity_and_hint(irq, mask);
+	else irq_update_affinity_hint(irq, NULL);
+#else
+	irq_set_affinity_hint(irq, mask);
+#endif
 }
 
 static int acquiresGPIO(void)
 {
 	int res = -ENODEV;
+	// SK3X4MX needs both edges for the software UART and the key-down time
+	unsigned long trigger = ay_d19m_mode == SK3X4MX ? IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING : IRQF_TRIGGER_FALLING;
 
+	// sampled through suspend and resume, see pmstat
+	if (ay_d19m_wakeup) trigger |= IRQF_NO_SUSPEND;
+
+	sk3x4mx = ay_d19m_mode == SK3X4MX;
 	if (!gpio_is_valid(ay_d19m_d0))
 	{
 		printk(KERN_INFO CLASS_NAME ": invalid D0 GPIO\n");
@@ -431,20 +1707,34 @@ static int acquiresGPIO(void)
 		if ( 0 <= (res = irqlineD0 = gpio_to_irq(ay_d19m_d0)) && 0 <= (res = irqlineD1 = gpio_to_irq(ay_d19m_d1)))
 		{
 			printk(KERN_INFO CLASS_NAME ": The D0/D1 mapped to IRQ: %d/%d\n", irqlineD0, irqlineD1);
+			if (ay_d19m_batch)
+			{
+				batchdesc[0] = gpio_to_desc(ay_d19m_d0);
+				batchdesc[1] = gpio_to_desc(ay_d19m_d1);
+				printk(KERN_INFO CLASS_NAME ": D0/D1 batched sampling, %s\n",
+				        gpiod_to_chip(batchdesc[0]) == gpiod_to_chip(batchdesc[1]) ? "one bank read" : "one read per chip");
+			}
 			res = request_irq(irqlineD0,	// The interrupt number requested
 			        ay_d19m_irqdata,	// The pointer to the handler function below
-			        IRQF_TRIGGER_FALLING,	// Interrupt on rising edge (button press, not release)
+			        trigger,	// Interrupt on falling edge, both edges on SK3X4MX
 			        "ay_d19m D0 gpio_handler",	// Used in /proc/interrupts to identify the owner
 			        0);	// The *dev_id for shared interrupt lines, NULL is okay
 			printk(KERN_INFO CLASS_NAME ": The D0 interrupt request result is: %d\n", res);
 
 			res = request_irq(irqlineD1,	// The interrupt number requested
 			        ay_d19m_irqdata,	// The pointer to the handler function below
-			        IRQF_TRIGGER_FALLING,	// Interrupt on rising edge (button press, not release)
+			        trigger,	// Interrupt on falling edge, both edges on SK3X4MX
 			        "ay_d19m D1 gpio_handler",	// Used in /proc/interrupts to identify the owner
 			        0);	// The *dev_id for shared interrupt lines, NULL is okay
 			printk(KERN_INFO CLASS_NAME ": The D1 interrupt request result is: %d\n", res);
 
+			if (ay_d19m_cpu >= 0)
+			{
+				ay_d19m_affinity(irqlineD0, cpumask_of(ay_d19m_cpu));
+				ay_d19m_affinity(irqlineD1, cpumask_of(ay_d19m_cpu));
+				printk(KERN_INFO CLASS_NAME ": D0/D1 IRQ affinity CPU %d\n", ay_d19m_cpu);
+			}
+
 		}
 		else printk(KERN_ERR CLASS_NAME ": Can not set irq on GPIO (Wiegand D0/D1) lines.\n");
 	}
@@ -456,9 +1746,13 @@ static int acquiresGPIO(void)
 static int releaseGPIO(void)
 {
 	powerOff();        						// Turn the Power off.
+	if (irqlineD0) ay_d19m_affinity(irqlineD0, NULL);
+	if (irqlineD1) ay_d19m_affinity(irqlineD1, NULL);
 	if (irqlineD0) free_irq(irqlineD0, 0);  // Free the IRQ number for D0 line
 	if (irqlineD1) free_irq(irqlineD1, 0);  // Free the IRQ number for D1 line
 	irqlineD0 = irqlineD1 = 0;
+	irqprio[0] = irqprio[1] = 0;
+	batchdesc[0] = batchdesc[1] = NULL;
 
 	gpio_free(ay_d19m_power);   // Free the Power GPIO
 	gpio_free(ay_d19m_d0);      // Free the D0 GPIO
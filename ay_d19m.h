@@ -21,6 +21,9 @@
 #ifndef _AY_D19M_H
 #define _AY_D19M_H
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
 /* Raspberry PI 3 Model B+ with Iono PI IPMB20RP IO-Board
  * module_param
  * ay_d19m_power, 	GPIO-Output-Pin for AYD19M Power-Control. Default GPIO18
@@ -36,4 +39,96 @@
 #define AY_D19M_D0 		4		/* GPIO4    in   Iono Wiegand DATA0 generic TTL I/O */
 #define AY_D19M_D1 		26 	/* GPIO26   in   Iono Wiegand DATA1 generic TTL I/O */
 
+#define AY_D19M_BAUD	9600	/* SK3X4MX ASCII baud rate on DATA0                  */
+#define AY_D19M_EDGES	128		/* SK3X4MX edge log depth                            */
+#define AY_D19M_QUIET	10		/* SK3X4MX ms without edge closing the capture       */
+#define AY_D19M_KEYMIN	1		/* SK3X4MX ms DATA1 low, longer is a key not a bit   */
+#define AY_D19M_RING	64		/* raw frames queued for the reader                  */
+#define AY_D19M_FILES	8		/* /dev/ayd19m files open at a time                  */
+#define AY_D19M_DUPHASH	4		/* log2 entries of the duplicate suppression table   */
+#define AY_D19M_POLLBIT	4000	/* longest Wiegand bit interval in us polled     */
+#define AY_D19M_POLLREPLAY	200		/* IRQ us after enable with D0/D1 high is replayed */
+#define AY_D19M_POLLMIN	20		/* shortest ay_d19m_poll offset into a pulse in us */
+#define AY_D19M_PINMAX	12		/* keys held with a card for the PIN                 */
+#define AY_D19M_TRACESUB	16384	/* edge trace relay sub-buffer bytes             */
+#define AY_D19M_TRACEBUFS	16		/* edge trace sub-buffers per CPU                */
+
+/* ioctl on /dev/ayd19m, per open file */
+#define AYD19M_IOC_MAGIC	'W'
+
+struct ayd19m_coalesce
+{
+	__u32 records;		/* wake the reader at n queued records, 1..AY_D19M_RING      */
+	__u32 usecs;		/* or when the oldest is us old. 0, wake on every record    */
+	__u32 wakeups;		/* get only, times the reader was woken                     */
+};
+
+#define AYD19M_SET_COALESCE	_IOW(AYD19M_IOC_MAGIC, 1, struct ayd19m_coalesce)
+#define AYD19M_GET_COALESCE	_IOR(AYD19M_IOC_MAGIC, 2, struct ayd19m_coalesce)
+
+/* record classes */
+#define AYD19M_CLASS_KEY	0x1		/* single key                                      */
+#define AYD19M_CLASS_PIN	0x2		/* PIN frame (modes 4..6) or card with P=          */
+#define AYD19M_CLASS_CARD	0x4		/* Wiegand 26 card                                 */
+#define AYD19M_CLASS_OTHER	0x8		/* not supported frame                             */
+
+/* a record is queued to the file only if it matches all fields */
+struct ayd19m_filter
+{
+	__u32 results;		/* bit n passes R=n, 0xF all                                 */
+	__u32 classes;		/* AYD19M_CLASS_* passed                                     */
+	__u32 facmin;		/* facility code range, records without F= pass             */
+	__u32 facmax;
+	__u32 bitsmin;		/* frame length range (L=)                                   */
+	__u32 bitsmax;
+};
+
+#define AYD19M_FILTER_ALL	{ 0xF, 0xF, 0, 0xFFFFFFFF, 0, 32 }
+
+#define AYD19M_SET_FILTER	_IOW(AYD19M_IOC_MAGIC, 3, struct ayd19m_filter)
+#define AYD19M_GET_FILTER	_IOR(AYD19M_IOC_MAGIC, 4, struct ayd19m_filter)
+
+/*
+ * Status page, /sys/class/AYD19M/ayd19m/status, read only and mmap-able.
+ * seq is odd while the driver updates the page, a copy is consistent if
+ * seq was even and unchanged before and after it.
+ */
+struct ayd19m_status
+{
+	__u32 seq;
+	__u32 size;			/* sizeof(struct ayd19m_status) of the driver              */
+	__u64 updated;		/* ktime ns of the last update                             */
+
+	/* last decoded frame */
+	__u64 ts;			/* ktime ns queued                                         */
+	__u64 start;		/* ktime ns of the first edge                              */
+	__u32 code;
+	__u32 bits;
+	__u32 mode;			/* ay_d19m_mode it was decoded in                          */
+	__u32 frame;		/* frame number, 0 no frame yet                            */
+	__u32 format;		/* fmt_mode() of its formatter, format with fmt_of()       */
+	__u32 result;		/* R= of the record                                        */
+	__u32 facility;		/* F= of the record, 0xFFFFFFFF none                        */
+	__u32 haspin;		/* card queued with a PIN, the PIN is not shown            */
+
+	/* state */
+	__u32 power;		/* reader powered                                          */
+	__u32 suspended;	/* system suspended, next frame is a wakeup               */
+	__u32 files;		/* /dev/ayd19m open                                        */
+
+	/* counters since load */
+	__u32 frames;		/* frames queued, duplicates not counted                   */
+	__u32 biterrs;		/* Wiegand frames dropped on D0/D1 mismatch                */
+	__u32 overruns;		/* records lost on full reader queues                      */
+	__u32 dupdrop;		/* duplicates suppressed, ay_d19m_dupwin                   */
+	__u32 pinpairs;		/* cards queued with PIN, ay_d19m_pinwin                   */
+	__u32 edges;		/* edges logged                                            */
+	__u32 edgeslost;	/* edges lost on a full edge log                           */
+	__u32 irqs;			/* edges taken by IRQ, ay_d19m_poll                        */
+	__u32 windows;		/* frames polled, ay_d19m_poll                             */
+	__u32 ticks;		/* poll timer ticks, about one per bit                     */
+	__u32 wakeups;		/* frames captured after a wakeup                          */
+	__u64 wakelatmax;	/* ns waking edge to frame completion                      */
+};
+
 #endif /* _AY_D19M_H */
@@ -8,7 +8,7 @@
 #include "ay_d19m.h"
 #include "decoder.h"
 
-int fmt_wiegand26(uint32_t code0, int bits,  char *buffer, size_t bsz)
+int fmt_wiegand26(uint32_t code0, int bits,  char *buffer, size_t bsz, int m)
 {
 	int i;
 	unsigned ep=0, op=1, facility;
@@ -25,26 +25,30 @@ int fmt_wiegand26(uint32_t code0, int bits,  char *buffer, size_t bsz)
 
 	if (ep & op)
 	{
-		snprintf(buffer, bsz, "R=%d, M=%d, F=%d, D=%X, L=%d", RES_OK, -mode(), facility, code, bits);
+		snprintf(buffer, bsz, "R=%d, M=%d, F=%d, D=%X, L=%d", RES_OK, -m, facility, code, bits);
 	}
 	else
 	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, -mode(), code0, bits);
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, -m, code0, bits);
 	}
 
 	return strlen(buffer);
 
 }
 
+int fmt_nosupport(uint32_t code0, int bits, char *buffer, size_t bsz, int m)
+{
+	snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_NOSUPORT, m, code0, bits);
+	return strlen(buffer);
+}
+
 // Single Key, Wiegand 6-Bit (Rosslare Format). Factory setting
-int fmt_SKW06RF(uint32_t code0, int bits,  char *buffer, size_t bsz)
+static int key_SKW06RF(uint32_t code0)
 {
 	int i;
 	unsigned ep=0, op=1;
 	uint16_t code;
 
-	*buffer = 0;
-
 	code = (code0 >> 1) & 0xF;
 
 	for (i = 0; i < 3; i++)
@@ -53,36 +57,34 @@ int fmt_SKW06RF(uint32_t code0, int bits,  char *buffer, size_t bsz)
 		op ^= code0 & (8 << i) ? 1:0;
 	}
 
-	if (ep & op)
-	{
-		if(code && code != 12 && code != 13 && code < 15)
-		{
-			char key;
-			if (code == 10) key = '0';
-			else if (code == 11) key = '*';
-			else if (code == 14) key = '#';
-			else key = '0' + code;
-			snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', L=%d", RES_OK, mode(), key, bits);
-		}
-		else
-			snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_DATAERR, mode(), code0, bits);
-	}
+	if (!(ep & op))
+		return -RES_PARITY;
+	if (!code || code == 12 || code == 13 || code >= 15)
+		return -RES_DATAERR;
+	if (code == 10) return '0';
+	if (code == 11) return '*';
+	if (code == 14) return '#';
+	return '0' + code;
+}
+
+int fmt_SKW06RF(uint32_t code0, int bits,  char *buffer, size_t bsz, int m)
+{
+	int key = key_SKW06RF(code0);
+
+	if (key > 0)
+		snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', L=%d", RES_OK, m, key, bits);
 	else
-	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, mode(), code0, bits);
-	}
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", -key, m, code0, bits);
 	return strlen(buffer);
 }
 
 // Single Key, Wiegand 6-Bit with Nibble + Parity Bits
-int fmt_SKW06NP(uint32_t code0, int bits,  char *buffer, size_t bsz)
+static int key_SKW06NP(uint32_t code0)
 {
 	int i;
 	unsigned ep=0, op=1;
 	uint16_t code;
 
-	*buffer = 0;
-
 	code = (code0 >> 1) & 0xF;
 
 	for (i = 0; i < 3; i++)
@@ -91,51 +93,54 @@ int fmt_SKW06NP(uint32_t code0, int bits,  char *buffer, size_t bsz)
 		op ^= code0 & (8 << i) ? 1:0;
 	}
 
-	if (ep & op)
-	{
-		if(code < 12)
-		{
-			char key;
-			if (code == 10) key = '*';
-			else if (code == 11) key = '#';
-			else key = '0' + code;
-			snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', L=%d", RES_OK, mode(), key, bits);
-		}
-		else
-			snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_DATAERR, mode(), code0, bits);
-	}
+	if (!(ep & op))
+		return -RES_PARITY;
+	if (code >= 12)
+		return -RES_DATAERR;
+	if (code == 10) return '*';
+	if (code == 11) return '#';
+	return '0' + code;
+}
+
+int fmt_SKW06NP(uint32_t code0, int bits,  char *buffer, size_t bsz, int m)
+{
+	int key = key_SKW06NP(code0);
+
+	if (key > 0)
+		snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', L=%d", RES_OK, m, key, bits);
 	else
-	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, mode(), code0, bits);
-	}
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", -key, m, code0, bits);
 
 	return strlen(buffer);
 }
 
 // Single Key, Wiegand 8-Bit, Nibbles Complemented
-int fmt_SKW08NC(uint32_t code0, int bits, char *buffer, size_t bsz)
+static int key_SKW08NC(uint32_t code0)
 {
 	uint16_t code = code0 & 0xF;
 	uint16_t icode = (code0 >> 4) & 0xF;
 
-	if ((code ^ icode) == 0xF)
-	{
-		char key;
-		if (code == 10) key = '*';
-		else if (code == 11) key = '#';
-		else key = '0' + code;
-		snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', L=%d", RES_OK, mode(), key, bits);
-	}
+	if ((code ^ icode) != 0xF)
+		return -RES_DATAERR;
+	if (code == 10) return '*';
+	if (code == 11) return '#';
+	return '0' + code;
+}
+
+int fmt_SKW08NC(uint32_t code0, int bits, char *buffer, size_t bsz, int m)
+{
+	int key = key_SKW08NC(code0);
+
+	if (key > 0)
+		snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', L=%d", RES_OK, m, key, bits);
 	else
-	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_DATAERR, mode(), code0, bits);
-	}
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", -key, m, code0, bits);
 
 	return strlen(buffer);
 }
 
 // 4 Keys Binary + Facility code, Wiegand 26-Bit
-int fmt_K4W26BF(uint32_t code0, int bits, char *buffer, size_t bsz)
+int fmt_K4W26BF(uint32_t code0, int bits, char *buffer, size_t bsz, int m)
 {
 	int i;
 	unsigned ep=0, op=1, facility;
@@ -152,18 +157,18 @@ int fmt_K4W26BF(uint32_t code0, int bits, char *buffer, size_t bsz)
 
 	if (ep & op)
 	{
-		snprintf(buffer, bsz, "R=%d, M=%d, F=%d, D=%d, L=%d", RES_OK, mode(), facility, code, bits);
+		snprintf(buffer, bsz, "R=%d, M=%d, F=%d, D=%d, L=%d", RES_OK, m, facility, code, bits);
 	}
 	else
 	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, mode(), code0, bits);
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, m, code0, bits);
 	}
 
 	return strlen(buffer);
 }
 
 // 1 to 5 Keys + Facility code, Wiegand 26-Bit
-int fmt_K5W26FC(uint32_t code0, int bits, char *buffer, size_t bsz)
+int fmt_K5W26FC(uint32_t code0, int bits, char *buffer, size_t bsz, int m)
 {
 	int i;
 	unsigned ep=0, op=1, facility;
@@ -191,7 +196,7 @@ int fmt_K5W26FC(uint32_t code0, int bits, char *buffer, size_t bsz)
 }
 
 // 6 Keys BCD and Parity Bits, Wiegand 26-Bit
-int fmt_K6W26BCD(uint32_t code0, int bits, char *buffer, size_t bsz)
+int fmt_K6W26BCD(uint32_t code0, int bits, char *buffer, size_t bsz, int m)
 {
 	int i;
 	unsigned ep=0, op=1;
@@ -207,24 +212,229 @@ int fmt_K6W26BCD(uint32_t code0, int bits, char *buffer, size_t bsz)
 
 	if (ep & op)
 	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%6.6X, L=%d", RES_OK, mode(), code, bits);
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%6.6X, L=%d", RES_OK, m, code, bits);
 	}
 	else
 	{
-		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, mode(), code0, bits);
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_PARITY, m, code0, bits);
 	}
 
 	return strlen(buffer);
 }
 
-int fmt_SK3X4MX(uint32_t code0, int bits, char *buffer, size_t bsz) // not supported yet 		Single Key, 3x4 Matrix Keypad
+// Single Key, 3x4 Matrix Keypad, ASCII 9600 Baud on DATA0
+static int key_SK3X4MX(uint32_t code0)
 {
-	snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_NOSUPORT, mode(), code0, bits);
+	char key = code0 & 0xFF;
+
+	if ((key >= '0' && key <= '9') || key == '*' || key == '#')
+		return key;
+	return -RES_DATAERR;
+}
+
+int fmt_SK3X4MX(uint32_t code0, int bits, char *buffer, size_t bsz, int m)
+{
+	int key = key_SK3X4MX(code0);
+	unsigned ms = code0 >> 8;
+
+	if (key > 0)
+	{
+		snprintf(buffer, bsz, "R=%d, M=%d, K=\'%c\', T=%u, L=%d", RES_OK, m, key, ms, bits);
+	}
+	else
+	{
+		snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", -key, m, code0, bits);
+	}
+
 	return strlen(buffer);
 }
 
-int fmt_K8CDBCD(uint32_t code0, int bits, char *buffer, size_t bsz) // not supported yet 		1 to 8 Keys BCD, Clock & Data Single Key
+int fmt_key(fmt f, uint32_t code0)
+{
+	if (f == fmt_SKW06RF) return key_SKW06RF(code0);
+	if (f == fmt_SKW06NP) return key_SKW06NP(code0);
+	if (f == fmt_SKW08NC) return key_SKW08NC(code0);
+	if (f == fmt_SK3X4MX) return key_SK3X4MX(code0);
+	return 0;
+}
+
+// even parity over bits 0..12 and odd parity over bits 13..25, as the 26 bit formatters
+static int parity26(uint32_t code0)
+{
+	int i;
+	unsigned ep=0, op=1;
+
+	for (i = 0; i < 13; i++)
+	{
+		ep ^= code0 & (1 << i) ? 1:0;
+		op ^= code0 & (0x2000 << i) ? 1:0;
+	}
+	return ep & op;
+}
+
+int fmt_result(fmt f, uint32_t code0, int bits, unsigned *facility)
+{
+	int key = fmt_key(f, code0);
+
+	if (key) return key > 0 ? RES_OK : -key;
+	if (f == fmt_wiegand26 || f == fmt_K4W26BF || f == fmt_K5W26FC || f == fmt_K6W26BCD)
+	{
+		if (!parity26(code0)) return RES_PARITY;
+		// F= as printed, K6W26BCD has none
+		if (f != fmt_K6W26BCD) *facility = (code0 >> 16) & 0xFF;
+		return RES_OK;
+	}
+	return RES_NOSUPORT;
+}
+
+void wiegand_bit(ayd19m_wiegand_t *w, int line, uint64_t ts)
+{
+	if (w->bits >= 32) return;
+	if (!w->bits) w->start = ts;
+	w->d0 = w->d0 << 1 | (line ? 1 : 0);
+	w->d1 = w->d1 << 1 | (line ? 0 : 1);
+	w->bits++;
+}
+
+void wiegand_sample(ayd19m_wiegand_t *w, const ayd19m_edge_t *e)
+{
+	wiegand_bit(w, e->line, e->ts);
+	// the other line low as well, keep it a bit error
+	if (!(e->level & (e->line ? 1 : 2))) w->d1 = (w->d1 & ~1) | (w->d0 & 1);
+}
+
+int wiegand_valid(const ayd19m_wiegand_t *w)
+{
+	return (w->d0 ^ w->d1) == (w->bits < 32 ? (1u << w->bits) - 1 : ~0u);
+}
+
+uint64_t sk3x4mx_edge(ayd19m_sk3x4mx_t *s, ayd19m_wiegand_t *w, const ayd19m_edge_t *e)
+{
+	uint64_t down = 0;
+
+	if (e->line)
+	{
+		if (!e->level)
+			s->down = e->ts;
+		else if (!s->d1 && e->ts - s->down >= AY_D19M_KEYMIN * NSEC_PER_MSEC)
+			down = e->ts - s->down;
+		else if (!s->d1)
+		{
+			wiegand_bit(w, 1, s->down);
+			s->cnt = 0;
+		}
+		s->d1 = e->level;
+	}
+	else if (!s->d1)
+	{
+		if (s->cnt < AY_D19M_EDGES) s->uart[s->cnt++] = *e;
+	}
+	else if (!e->level)
+		wiegand_bit(w, 0, e->ts);
+
+	return down;
+}
+
+int sk3x4mx_keys(ayd19m_sk3x4mx_t *s, uint64_t down, uint32_t *code, int max)
+{
+	uint8_t c[4];
+	uint64_t ms = div_u64(down, NSEC_PER_MSEC);
+	int i, n = uart_decode(s->uart, s->cnt, NSEC_PER_SEC / AY_D19M_BAUD, c, max < 4 ? max : 4);
+
+	s->cnt = 0;
+	if (ms > 0xFFFFFF) ms = 0xFFFFFF;
+	if (!n && max) c[n++] = 0;		// key down without character
+
+	for (i = 0; i < n; i++)
+		code[i] = (uint32_t)ms << 8 | c[i];
+	return n;
+}
+
+static const int wiegandLength[] = { 26, 6, 6, 8, 26, 26, 26, 0, 0 };
+
+static const fmt ffmt[] = {
+		fmt_wiegand26,
+		fmt_SKW06RF,
+		fmt_SKW06NP,
+		fmt_SKW08NC,
+		fmt_K4W26BF,
+		fmt_K5W26FC,
+		fmt_K6W26BCD,
+		fmt_SK3X4MX,
+		fmt_K8CDBCD
+};
+
+fmt wiegand_fmt(unsigned m, int bits)
+{
+	if (m < sizeof(ffmt) / sizeof(ffmt[0]) && wiegandLength[m] && bits == wiegandLength[m])
+		return ffmt[m];
+	if (bits == 26)
+		return fmt_wiegand26;
+	return fmt_nosupport;
+}
+
+int fmt_mode(fmt f)
+{
+	int m;
+
+	for (m = 0; m < sizeof(ffmt) / sizeof(ffmt[0]); m++)
+		if (ffmt[m] == f) return m;
+	return -1;
+}
+
+fmt fmt_of(int m)
+{
+	if (m >= 0 && m < sizeof(ffmt) / sizeof(ffmt[0]))
+		return ffmt[m];
+	return fmt_nosupport;
+}
+
+// 8N1 receiver working on edge timestamps, sampling at the bit centers
+int uart_decode(const ayd19m_edge_t *e, int n, uint64_t bitns, uint8_t *out, int max)
+{
+	int i = 0, b, level, cnt = 0;
+	uint64_t t0;
+	uint8_t c;
+
+	while (i < n && cnt < max)
+	{
+		// seek the start bit, a falling edge on DATA0
+		if (e[i].line || e[i].level)
+		{
+			i++;
+			continue;
+		}
+		t0 = e[i].ts;
+		level = 0;
+		c = 0;
+
+		// b = 0 start bit, 1..8 data bits, 9 stop bit
+		for (b = 0; b < 10; b++)
+		{
+			uint64_t ts = t0 + bitns * (2 * b + 1) / 2;
+
+			while (i + 1 < n && e[i + 1].ts <= ts)
+			{
+				i++;
+				if (!e[i].line) level = e[i].level;
+			}
+			if (!b && level) break;		// glitch, no valid start bit
+			if (b > 0 && b < 9 && level) c |= 1 << (b - 1);
+		}
+		if (!b)
+		{
+			i++;
+			continue;
+		}
+
+		out[cnt++] = level ? c : 0;		// stop bit must be high
+		i++;
+	}
+	return cnt;
+}
+
+int fmt_K8CDBCD(uint32_t code0, int bits, char *buffer, size_t bsz, int m) // not supported yet 		1 to 8 Keys BCD, Clock & Data Single Key
 {
-	snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_NOSUPORT, mode(), code0, bits);
+	snprintf(buffer, bsz, "R=%d, M=%d, D=%8.8X, L=%d", RES_NOSUPORT, m, code0, bits);
 	return strlen(buffer);
 }
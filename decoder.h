@@ -7,16 +7,154 @@
 
 #ifndef DECODER_H_
 #define DECODER_H_
+#ifdef __KERNEL__
 #include <linux/types.h>	/* size_t */
 #include <linux/kernel.h>	/* printk() */
 #include <linux/module.h>
+#else
+/* shared with the userspace tools in user/ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define div_u64(a, b)	((a) / (b))
+#endif
+#include "ay_d19m.h"
 
 
 #define	MAX_READSZ		60
 
-typedef int (*fmt)( uint32_t, int, char *, size_t);
+/*
+ * Record formatter, code0 and bits of the frame, m the reader mode it
+ * was captured in (M=).
+ */
+typedef int (*fmt)(uint32_t, int, char *, size_t, int);
+
+/*
+ * One captured D0/D1 edge. ts is the ktime in ns the edge was seen,
+ * line is 0 for DATA0 and 1 for DATA1, level the line level after the edge.
+ */
+typedef struct {
+	uint64_t ts;
+	uint8_t line;
+	uint8_t level;
+} ayd19m_edge_t;
+
+/*
+ * Software UART, 8N1, LSB first, idle high.
+ * Samples the DATA0 edges in e[0..n-1] in the middle of each bit cell,
+ * bitns is the bit time in ns (104167 at 9600 baud). Edges on DATA1
+ * are skipped. Decoded bytes are stored in out, a byte with a framing
+ * error (stop bit low) is stored as 0.
+ * Returns the number of bytes stored.
+ */
+int uart_decode(const ayd19m_edge_t *e, int n, uint64_t bitns, uint8_t *out, int max);
+
+/*
+ * Wiegand frame assembled from falling edges, an edge on DATA0 is a 0 bit,
+ * on DATA1 a 1 bit. d0 holds the bits, d1 the complement, as the lines
+ * read at each edge. The first bit ends up in bit (bits - 1).
+ */
+typedef struct {
+	uint32_t d0, d1;
+	int bits;
+	uint64_t start;		// ns of the first edge
+} ayd19m_wiegand_t;
+
+void wiegand_bit(ayd19m_wiegand_t *w, int line, uint64_t ts);
 
-int fmt_wiegand26(uint32_t code0, int bits,  char *buffer, size_t bsz);
+/*
+ * Falling edge on e->line with the D0/D1 sample in e->level (bit 0 D0,
+ * bit 1 D1). Both lines low is stored as a bit error.
+ */
+void wiegand_sample(ayd19m_wiegand_t *w, const ayd19m_edge_t *e);
+
+/*
+ * D0 and D1 complement each other over all bits.
+ */
+int wiegand_valid(const ayd19m_wiegand_t *w);
+
+/*
+ * Edge trace record, streamed by the driver through debugfs ayd19m/trace*
+ * (one file per CPU) and read back by user/ayd19mreplay.
+ * Records of all files merged in seq order give the capture order. An
+ * edge has its position in the edge log as seq, a frame the position of
+ * the first edge after it and sorts before that edge.
+ */
+enum {
+	AYD19M_TRACE_EDGE = 1,	// e.line, e.level as logged for the decoder
+	AYD19M_TRACE_FRAME,		// frame closed by the frame timer
+};
+
+typedef struct {
+	uint64_t ts;	// ktime ns
+	uint32_t seq;
+	uint8_t type;
+	uint8_t line;
+	uint8_t level;
+	uint8_t mode;
+} ayd19m_trace_t;
+
+/*
+ * SK3X4MX capture, fed with both edges of DATA0/DATA1.
+ */
+typedef struct {
+	int d1;				// DATA1 level
+	uint64_t down;		// ns DATA1 went low
+	int cnt;
+	ayd19m_edge_t uart[AY_D19M_EDGES];	// DATA0 edges while DATA1 is low
+} ayd19m_sk3x4mx_t;
+
+#define SK3X4MX_INIT	{ .d1 = 1 }
+
+/*
+ * DATA0 edges while DATA1 is low are the UART character of a key, short
+ * pulses on DATA0/DATA1 are Wiegand card bits and go to w.
+ * Returns the key-down time in ns if e released a key, else 0.
+ */
+uint64_t sk3x4mx_edge(ayd19m_sk3x4mx_t *s, ayd19m_wiegand_t *w, const ayd19m_edge_t *e);
+
+/*
+ * Decode the key released after down ns into fmt_SK3X4MX codes.
+ * Returns the number of codes, at least 1 if max > 0.
+ */
+int sk3x4mx_keys(ayd19m_sk3x4mx_t *s, uint64_t down, uint32_t *code, int max);
+
+/*
+ * Formatter for a Wiegand frame of bits in reader mode m.
+ */
+fmt wiegand_fmt(unsigned m, int bits);
+
+/*
+ * Number of a formatter, the reader mode it formats or -1 for
+ * fmt_nosupport, and back. Raw frames are stored with the number.
+ */
+int fmt_mode(fmt f);
+fmt fmt_of(int m);
+
+int fmt_wiegand26(uint32_t code0, int bits,  char *buffer, size_t bsz, int m);
+
+/*
+ * Frame length does not match the mode, code0 is printed raw.
+ */
+int fmt_nosupport(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
+
+/*
+ * Key of a single key frame formatted by f, the ASCII character
+ * ('0'..'9', '*', '#'), -RES_PARITY or -RES_DATAERR if it is invalid.
+ * 0 if f is no single key format.
+ */
+int fmt_key(fmt f, uint32_t code0);
+
+/*
+ * Result code (R=) of the record f formats, the facility code (F=) is
+ * stored in *facility if the record has one, else it is left unchanged.
+ * Taken from the bits like the formatters, nothing is formatted.
+ */
+int fmt_result(fmt f, uint32_t code0, int bits, unsigned *facility);
 
 typedef enum {
 	RES_OK,
@@ -35,11 +173,10 @@ typedef enum  { // Read format			Description
     K4W26BF,    // "M=4, F=%d, C=%d" 	4 Keys Binary + Facility code, Wiegand 26-Bit
     K5W26FC,    // "M=5, F=%d, C=%d" 	1 to 5 Keys + Facility code, Wiegand 26-Bit
     K6W26BCD,   // "M=6, F=%d, C=%d"	6 Keys BCD and Parity Bits, Wiegand 26-Bit
-    SK3X4MX,    // M=7 not supported yet	Single Key, 3x4 Matrix Keypad
+    SK3X4MX,    // "M=7, K=%c, T=%d"		Single Key, 3x4 Matrix Keypad, 9600 Baud ASCII on DATA0
     K8CDBCD,    // M=8 not supported yet	1 to 8 Keys BCD, Clock & Data Single Key
 }ayd19m_mode_t;
 
-ayd19m_mode_t mode(void);
 
 /*
  * SKW06RF
@@ -64,7 +201,7 @@ ayd19m_mode_t mode(void);
  * * = 1 1011 1 = "B" in Hexadecimal
  * # = 0 1110 0 = "E" in Hexadecimal
  */
-int fmt_SKW06RF(uint32_t code0, int bits,  char *buffer, size_t bsz);
+int fmt_SKW06RF(uint32_t code0, int bits,  char *buffer, size_t bsz, int m);
 
 /*
  * SKW06NP
@@ -89,7 +226,7 @@ int fmt_SKW06RF(uint32_t code0, int bits,  char *buffer, size_t bsz);
  * * = 1 1010 0 = "A" in Hexadecimal
  * # = 1 1011 1 = "B" in Hexadecimal
  */
-int fmt_SKW06NP(uint32_t code0, int bits,  char *buffer, size_t bsz);
+int fmt_SKW06NP(uint32_t code0, int bits,  char *buffer, size_t bsz, int m);
 
 /*
  * SKW08NC
@@ -110,7 +247,7 @@ int fmt_SKW06NP(uint32_t code0, int bits,  char *buffer, size_t bsz);
  * * = 01011010 = "A" in Hexadecimal
  * # = 01001011 = "B" in Hexadecimal
  */
-int fmt_SKW08NC(uint32_t code0, int bits, char *buffer, size_t bsz);
+int fmt_SKW08NC(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
 
 /*
  * K4W26BF
@@ -138,7 +275,7 @@ int fmt_SKW08NC(uint32_t code0, int bits, char *buffer, size_t bsz);
  * F = 8-bit Facility code
  * A = 24-bit code generated from keyboard
  */
-int fmt_K4W26BF(uint32_t code0, int bits, char *buffer, size_t bsz);
+int fmt_K4W26BF(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
 
 /*
  * K5W26FC
@@ -171,7 +308,7 @@ int fmt_K4W26BF(uint32_t code0, int bits, char *buffer, size_t bsz);
  * F = 8-bit Facility code
  * A = 24-bit code generated from keyboard
  */
-int fmt_K5W26FC(uint32_t code0, int bits, char *buffer, size_t bsz);
+int fmt_K5W26FC(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
 
 /*
  * K6W26BCD
@@ -191,7 +328,7 @@ int fmt_K5W26FC(uint32_t code0, int bits, char *buffer, size_t bsz);
  * B = Second key entered E = Fifth key entered
  * C = Third key entered F = Sixth key entered
  */
-int fmt_K6W26BCD(uint32_t code0, int bits, char *buffer, size_t bsz);
+int fmt_K6W26BCD(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
 
 /*
  * SK3X4MX
@@ -216,8 +353,11 @@ int fmt_K6W26BCD(uint32_t code0, int bits, char *buffer, size_t bsz);
  * 3 = '3' (0x33 hex) 9 = '9' (0x39 hex)
  * 4 = '4' (0x34 hex) *= '*' (0x2A hex)
  * 5 = '5' (0x35 hex) # = '#' (0x23 hex)
+ *
+ * code0 bit 0..7 holds the received ASCII character, bit 8..31 the
+ * key-down time in ms taken from the DATA1 low period.
  */
-int fmt_SK3X4MX(uint32_t code0, int bits, char *buffer, size_t bsz);
+int fmt_SK3X4MX(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
 
 /*
  * K8CDBCD
@@ -237,6 +377,6 @@ int fmt_SK3X4MX(uint32_t code0, int bits, char *buffer, size_t bsz);
  * entry buffer, generates a medium length beep and is ready to receive
  * a new keypad PIN code.
  */
-int fmt_K8CDBCD(uint32_t code0, int bits, char *buffer, size_t bsz);
+int fmt_K8CDBCD(uint32_t code0, int bits, char *buffer, size_t bsz, int m);
 
 #endif /* DECODER_H_ */
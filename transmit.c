@@ -0,0 +1,154 @@
+/*
+ * transmit.c
+ *
+ *  Wiegand transmitter, D0/D1 pulse trains timed by a hrtimer.
+ */
+
+#include "ay_d19m.h"
+#include "transmit.h"
+
+#include <linux/gpio.h>
+#include <linux/ktime.h>
+
+struct wiegand_txframe
+{
+	uint32_t data;
+	int bits;
+	uint64_t start;
+};
+
+static struct
+{
+	struct hrtimer timer;
+	spinlock_t lock;
+	int d0, d1;
+	ktime_t pulse, space, gap;
+	struct wiegand_txframe q[WIEGAND_TXQ];
+	unsigned head, tail;
+	int bit;		// next bit of q[head]
+	int low;		// GPIO pulled low, -1 none
+	int busy;		// timer running
+} tx = { .d0 = -1, .d1 = -1, .low = -1 };
+
+static enum hrtimer_restart wiegand_tx_timer(struct hrtimer *timer)
+{
+	struct wiegand_txframe *f, sent = { 0 };
+	unsigned long flags;
+	ktime_t next;
+
+	spin_lock_irqsave(&tx.lock, flags);
+	f = &tx.q[tx.head % WIEGAND_TXQ];
+	if (tx.low >= 0)
+	{
+		// end of pulse
+		gpio_set_value(tx.low, 1);
+		tx.low = -1;
+		next = tx.space;
+		if (++tx.bit == f->bits)
+		{
+			sent = *f;
+			tx.head++;
+			tx.bit = 0;
+			next = tx.gap;
+		}
+	}
+	else if (tx.head != tx.tail)
+	{
+		if (!tx.bit) f->start = ktime_get_ns();
+		tx.low = (f->data >> (f->bits - 1 - tx.bit)) & 1 ? tx.d1 : tx.d0;
+		gpio_set_value(tx.low, 0);
+		next = tx.pulse;
+	}
+	else
+	{
+		tx.busy = 0;
+		spin_unlock_irqrestore(&tx.lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&tx.lock, flags);
+
+	if (sent.bits) wiegand_tx_sent(sent.data, sent.bits, sent.start);
+
+	hrtimer_forward_now(timer, next);
+	return HRTIMER_RESTART;
+}
+
+int wiegand_tx(uint32_t data, int bits)
+{
+	unsigned long flags;
+	int res = 0;
+
+	if (tx.d0 < 0) return -ENODEV;
+	if (bits < 1 || bits > 32) return -EINVAL;
+
+	spin_lock_irqsave(&tx.lock, flags);
+	if (tx.tail - tx.head < WIEGAND_TXQ)
+	{
+		tx.q[tx.tail % WIEGAND_TXQ].data = data;
+		tx.q[tx.tail % WIEGAND_TXQ].bits = bits;
+		tx.tail++;
+		if (!tx.busy)
+		{
+			tx.busy = 1;
+			hrtimer_start(&tx.timer, 0, HRTIMER_MODE_REL);
+		}
+	}
+	else res = -EAGAIN;
+	spin_unlock_irqrestore(&tx.lock, flags);
+
+	return res;
+}
+
+int wiegand_tx_busy(void)
+{
+	return READ_ONCE(tx.busy);
+}
+
+int wiegand_tx_init(int d0, int d1, unsigned pulse, unsigned interval, unsigned gap)
+{
+	if (d0 < 0 || d1 < 0) return 0;		// TX not configured
+	if (!gpio_is_valid(d0) || !gpio_is_valid(d1) || !pulse || interval <= pulse)
+	{
+		printk(KERN_ERR CLASS_NAME ": invalid TX GPIO or timing\n");
+		return -EINVAL;
+	}
+	if (gpio_request_one(d0, GPIOF_OUT_INIT_HIGH, "av-d19m.tx.d0"))
+	{
+		printk(KERN_ERR CLASS_NAME ": Can not requst GPIO (TX D0) line.\n");
+		return -EBUSY;
+	}
+	if (gpio_request_one(d1, GPIOF_OUT_INIT_HIGH, "av-d19m.tx.d1"))
+	{
+		gpio_free(d0);
+		printk(KERN_ERR CLASS_NAME ": Can not requst GPIO (TX D1) line.\n");
+		return -EBUSY;
+	}
+
+	spin_lock_init(&tx.lock);
+	hrtimer_init(&tx.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tx.timer.function = wiegand_tx_timer;
+	tx.pulse = us_to_ktime(pulse);
+	tx.space = us_to_ktime(interval - pulse);
+	tx.gap = ms_to_ktime(gap);
+	tx.head = tx.tail = 0;
+	tx.bit = tx.busy = 0;
+	tx.low = -1;
+	tx.d0 = d0;
+	tx.d1 = d1;
+
+	printk(KERN_INFO CLASS_NAME ": TX D0/D1 GPIO%d/GPIO%d, pulse %uus, interval %uus, gap %ums\n", d0, d1, pulse, interval,
+	        gap);
+	return 0;
+}
+
+void wiegand_tx_exit(void)
+{
+	if (tx.d0 < 0) return;
+
+	hrtimer_cancel(&tx.timer);
+	gpio_set_value(tx.d0, 1);
+	gpio_set_value(tx.d1, 1);
+	gpio_free(tx.d0);
+	gpio_free(tx.d1);
+	tx.d0 = tx.d1 = -1;
+}
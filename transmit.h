@@ -0,0 +1,43 @@
+/*
+ * transmit.h
+ *
+ *  Wiegand transmitter, D0/D1 pulse trains timed by a hrtimer.
+ *  Used to pass frames through to a legacy panel and for the loopback
+ *  self-test (TX D0/D1 wired to the reader inputs, or gpio-sim).
+ */
+
+#ifndef TRANSMIT_H_
+#define TRANSMIT_H_
+#include <linux/types.h>	/* size_t */
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+
+#define WIEGAND_TXQ		16		/* frames queued for transmission */
+
+/*
+ * Request the TX GPIOs d0/d1 as outputs idle high.
+ * pulse	low time of a bit in us (Wiegand 20..100)
+ * interval	time from bit to bit in us (Wiegand 200..20000)
+ * gap		idle time after a frame in ms
+ */
+int wiegand_tx_init(int d0, int d1, unsigned pulse, unsigned interval, unsigned gap);
+void wiegand_tx_exit(void);
+
+/*
+ * Queue a frame of bits, MSB (bit bits-1) sent first.
+ * Returns 0, -ENODEV without TX lines or -EAGAIN if the queue is full.
+ */
+int wiegand_tx(uint32_t data, int bits);
+
+/*
+ * Frames queued or on the lines, 0 once the last gap has passed.
+ */
+int wiegand_tx_busy(void);
+
+/*
+ * Called in hrtimer context after the last pulse of a frame, start is the
+ * ktime in ns of its first pulse. Implemented by the driver.
+ */
+void wiegand_tx_sent(uint32_t data, int bits, uint64_t start);
+
+#endif /* TRANSMIT_H_ */
@@ -0,0 +1,332 @@
+/*
+ This file is part of ay-d19m.
+
+ ay-d19m project is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ ay-d19m project is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ay-d19m project.  If not, see <http://www.gnu.org/licenses/>.
+
+ ayd19md, userspace capture of the AYD19M Wiegand lines through the GPIO
+ character device (libgpiod v2). Frames are assembled and formatted with
+ the same decoder.c as the kernel module and written as /dev/ayd19m
+ records, so both can be benchmarked against each other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <gpiod.h>
+
+#include "../ay_d19m.h"
+#include "../decoder.h"
+
+#define EVBUF	64		/* edge events fetched per read */
+
+static const char *chippath = "/dev/gpiochip0";
+static unsigned d0line = AY_D19M_D0;
+static unsigned d1line = AY_D19M_D1;
+static int ay_d19m_mode = SKW06RF;
+static unsigned timeout = 40;	/* ms frame timeout, the kernel timer */
+static const char *outpath = NULL;
+static int stats = 0;
+
+static volatile sig_atomic_t running = 1;
+static int out = STDOUT_FILENO;
+
+static struct {
+	unsigned long frames;
+	unsigned long biterr;
+	unsigned long overrun;
+	unsigned long events;
+	unsigned long reads;
+	uint64_t latmin, latmax, latsum;
+} st;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+/*
+ * Write one record, terminated like the records of /dev/ayd19m.
+ */
+static void emit(fmt f, uint32_t code, int bits, uint64_t start)
+{
+	char text[MAX_READSZ + 2];
+	uint64_t lat;
+	int n;
+
+	n = f(code, bits, text, MAX_READSZ, ay_d19m_mode);
+	if (n < 0) return;
+	if (n > MAX_READSZ - 1) n = MAX_READSZ - 1;
+	text[n++] = '\n';
+	text[n++] = '\0';
+
+	if (write(out, text, n) != n)
+	{
+		st.overrun++;
+		return;
+	}
+
+	lat = now() - start;
+	if (!st.frames || lat < st.latmin) st.latmin = lat;
+	if (lat > st.latmax) st.latmax = lat;
+	st.latsum += lat;
+	st.frames++;
+}
+
+static void wiegand_frame(ayd19m_wiegand_t *w)
+{
+	if (wiegand_valid(w))
+		emit(wiegand_fmt(ay_d19m_mode, w->bits), w->d0, w->bits, w->start);
+	else
+	{
+		st.biterr++;
+		fprintf(stderr, CLASS_NAME ": Mode %d, bit-error! D0 %8.8X xor D1 %8.8X = %8.8X, bits %d\n",
+				ay_d19m_mode, w->d0, w->d1, w->d0 ^ w->d1, w->bits);
+	}
+	memset(w, 0, sizeof(*w));
+}
+
+static int openout(void)
+{
+	struct stat sb;
+
+	if (!outpath) return STDOUT_FILENO;
+
+	if (stat(outpath, &sb) && mkfifo(outpath, 0644))
+	{
+		perror(outpath);
+		return -1;
+	}
+	// O_RDWR keeps a FIFO open without reader, a full FIFO drops records
+	return open(outpath, O_RDWR | O_NONBLOCK | O_APPEND | O_CREAT, 0644);
+}
+
+static struct gpiod_line_request *request(struct gpiod_chip *chip)
+{
+	struct gpiod_line_settings *ls;
+	struct gpiod_line_config *lc;
+	struct gpiod_request_config *rc;
+	struct gpiod_line_request *req = NULL;
+	unsigned offs[2] = { d0line, d1line };
+
+	ls = gpiod_line_settings_new();
+	lc = gpiod_line_config_new();
+	rc = gpiod_request_config_new();
+	if (!ls || !lc || !rc) goto done;
+
+	gpiod_line_settings_set_direction(ls, GPIOD_LINE_DIRECTION_INPUT);
+	// rising edges too, they keep the level of the other line for wiegand_sample()
+	gpiod_line_settings_set_edge_detection(ls, GPIOD_LINE_EDGE_BOTH);
+	gpiod_line_settings_set_event_clock(ls, GPIOD_LINE_CLOCK_MONOTONIC);
+	if (gpiod_line_config_add_line_settings(lc, offs, 2, ls)) goto done;
+
+	gpiod_request_config_set_consumer(rc, DEVICE_NAME);
+	gpiod_request_config_set_event_buffer_size(rc, AY_D19M_EDGES);
+	req = gpiod_chip_request_lines(chip, rc, lc);
+
+done:
+	gpiod_request_config_free(rc);
+	gpiod_line_config_free(lc);
+	gpiod_line_settings_free(ls);
+	return req;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-c chip] [-0 d0] [-1 d1] [-m mode] [-t ms] [-o path] [-s]\n"
+			"  -c  GPIO chip, default %s\n"
+			"  -0  DATA0 line offset, default %u\n"
+			"  -1  DATA1 line offset, default %u\n"
+			"  -m  reader mode 0..8, default %d\n"
+			"  -t  frame timeout in ms, default %u\n"
+			"  -o  output file or FIFO (created), default stdout\n"
+			"  -s  print statistics on exit\n",
+			name, chippath, d0line, d1line, ay_d19m_mode, timeout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct gpiod_chip *chip;
+	struct gpiod_line_request *req;
+	struct gpiod_edge_event_buffer *buf;
+	struct gpiod_edge_event *ev;
+	ayd19m_wiegand_t w = { 0 };
+	ayd19m_sk3x4mx_t sk = SK3X4MX_INIT;
+	ayd19m_edge_t e;
+	enum gpiod_line_value v[2];
+	unsigned lines = 3;	// bit 0 D0, bit 1 D1 high
+	struct rusage ru;
+	uint32_t code[4];
+	uint64_t deadline = 0, down, t;
+	int64_t wait;
+	int i, j, k, n, c;
+
+	while ((c = getopt(argc, argv, "c:0:1:m:t:o:s")) != -1)
+	{
+		switch (c)
+		{
+		case 'c': chippath = optarg; break;
+		case '0': d0line = strtoul(optarg, NULL, 0); break;
+		case '1': d1line = strtoul(optarg, NULL, 0); break;
+		case 'm': ay_d19m_mode = atoi(optarg); break;
+		case 't': timeout = strtoul(optarg, NULL, 0); break;
+		case 'o': outpath = optarg; break;
+		case 's': stats = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (ay_d19m_mode < WIEGAND26 || ay_d19m_mode > K8CDBCD || !timeout)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	chip = gpiod_chip_open(chippath);
+	if (!chip)
+	{
+		perror(chippath);
+		return 1;
+	}
+	req = request(chip);
+	if (!req)
+	{
+		fprintf(stderr, CLASS_NAME ": request of lines %u/%u failed: %s\n", d0line, d1line, strerror(errno));
+		gpiod_chip_close(chip);
+		return 1;
+	}
+	buf = gpiod_edge_event_buffer_new(EVBUF);
+	out = openout();
+	if (!buf || out < 0)
+	{
+		gpiod_line_request_release(req);
+		gpiod_chip_close(chip);
+		return 1;
+	}
+
+	if (!gpiod_line_request_get_values(req, v))
+		lines = (v[0] == GPIOD_LINE_VALUE_ACTIVE ? 1 : 0) | (v[1] == GPIOD_LINE_VALUE_ACTIVE ? 2 : 0);
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (running)
+	{
+		wait = -1;
+		if (deadline)
+		{
+			t = now();
+			wait = deadline > t ? (int64_t)(deadline - t) : 0;
+		}
+
+		n = gpiod_line_request_wait_edge_events(req, wait);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("wait");
+			break;
+		}
+		if (!n)
+		{
+			// frame timeout, same as wiegand_timeoutfunc()
+			if (w.bits) wiegand_frame(&w);
+			deadline = 0;
+			continue;
+		}
+
+		n = gpiod_line_request_read_edge_events(req, buf, EVBUF);
+		if (n < 0)
+		{
+			perror("read");
+			break;
+		}
+		st.reads++;
+		st.events += n;
+
+		for (i = 0; i < n; i++)
+		{
+			ev = gpiod_edge_event_buffer_get_event(buf, i);
+			e.ts = gpiod_edge_event_get_timestamp_ns(ev);
+			e.line = gpiod_edge_event_get_line_offset(ev) == d1line;
+			e.level = gpiod_edge_event_get_event_type(ev) == GPIOD_EDGE_EVENT_RISING_EDGE;
+
+			// the frame ended before this edge, the wait did not time out in a busy batch
+			if (deadline && e.ts >= deadline)
+			{
+				if (w.bits) wiegand_frame(&w);
+				deadline = 0;
+			}
+
+			if (ay_d19m_mode == SK3X4MX)
+			{
+				down = sk3x4mx_edge(&sk, &w, &e);
+				if (down)
+				{
+					k = sk3x4mx_keys(&sk, down, code, 4);
+					for (j = 0; j < k; j++)
+						emit(fmt_SK3X4MX, code[j], 8, sk.down);
+				}
+				deadline = e.ts + AY_D19M_QUIET * NSEC_PER_MSEC;
+			}
+			else if (e.level)
+				lines |= 1 << e.line;
+			else
+			{
+				// both lines at this edge, D0/D1 low together is a bit-error
+				lines &= ~(1 << e.line);
+				e.level = lines;
+				wiegand_sample(&w, &e);
+				if (w.bits == 1) deadline = e.ts + timeout * NSEC_PER_MSEC;
+			}
+		}
+	}
+
+	if (w.bits) wiegand_frame(&w);
+
+	if (stats)
+	{
+		getrusage(RUSAGE_SELF, &ru);
+		fprintf(stderr, CLASS_NAME ": frames %lu, bit-errors %lu, dropped %lu\n", st.frames, st.biterr, st.overrun);
+		fprintf(stderr, CLASS_NAME ": events %lu, reads %lu, %.1f events/read\n",
+				st.events, st.reads, st.reads ? (double)st.events / st.reads : 0.0);
+		fprintf(stderr, CLASS_NAME ": latency first edge to record min %llu avg %llu max %llu us\n",
+				(unsigned long long)st.latmin / 1000,
+				(unsigned long long)(st.frames ? st.latsum / st.frames : 0) / 1000,
+				(unsigned long long)st.latmax / 1000);
+		fprintf(stderr, CLASS_NAME ": cpu user %ld.%06ld s, system %ld.%06ld s\n",
+				(long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec,
+				(long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+	}
+
+	gpiod_edge_event_buffer_free(buf);
+	gpiod_line_request_release(req);
+	gpiod_chip_close(chip);
+	if (out != STDOUT_FILENO) close(out);
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ This file is part of ay-d19m.
+
+ ay-d19m project is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ ay-d19m project is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ay-d19m project.  If not, see <http://www.gnu.org/licenses/>.
+
+ ayd19mreplay, feeds edge traces saved from debugfs ayd19m/trace* through
+ the frame assembler and decoder.c, the records are printed as read from
+ /dev/ayd19m (without the terminating 0).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../ay_d19m.h"
+#include "../decoder.h"
+
+static ayd19m_trace_t *rec;
+static size_t nrec;
+static int ay_d19m_mode = -1;	/* -m, else the mode recorded */
+static int curmode;
+
+static struct {
+	unsigned long frames;
+	unsigned long biterr;
+	unsigned long edges;
+} st;
+
+static ayd19m_mode_t mode(void)
+{
+	return ay_d19m_mode >= 0 ? ay_d19m_mode : curmode;
+}
+
+static int load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	ayd19m_trace_t t;
+	void *p;
+
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+	while (fread(&t, sizeof(t), 1, f) == 1)
+	{
+		if (t.type != AYD19M_TRACE_EDGE && t.type != AYD19M_TRACE_FRAME) continue;
+		if (!(nrec & (nrec + 1)))
+		{
+			p = realloc(rec, (nrec + 1) * 2 * sizeof(*rec));
+			if (!p)
+			{
+				fclose(f);
+				return -1;
+			}
+			rec = p;
+		}
+		rec[nrec++] = t;
+	}
+	fclose(f);
+	return 0;
+}
+
+// the per CPU files are merged in capture order, a frame before the edge of its seq
+static int byseq(const void *a, const void *b)
+{
+	const ayd19m_trace_t *ta = a, *tb = b;
+	int32_t d = ta->seq - tb->seq;
+
+	if (!d) return tb->type - ta->type;
+	return d < 0 ? -1 : d > 0;
+}
+
+static void emit(fmt f, uint32_t code, int bits, int print)
+{
+	char text[MAX_READSZ + 1];
+
+	st.frames++;
+	f(code, bits, text, MAX_READSZ, mode());
+	if (print) printf("%s\n", text);
+}
+
+static void frame(ayd19m_wiegand_t *w, int print)
+{
+	if (wiegand_valid(w))
+		emit(wiegand_fmt(mode(), w->bits), w->d0, w->bits, print);
+	else
+	{
+		st.biterr++;
+		if (print)
+			fprintf(stderr, CLASS_NAME ": Mode %d, bit-error! D0 %8.8X xor D1 %8.8X = %8.8X, bits %d\n",
+					mode(), w->d0, w->d1, w->d0 ^ w->d1, w->bits);
+	}
+	memset(w, 0, sizeof(*w));
+}
+
+/*
+ * One pass over the trace, the same steps as wiegand_timeoutfunc() and
+ * sk3x4mx_timeout() of the driver.
+ */
+static void replay(int print)
+{
+	static ayd19m_sk3x4mx_t sk;
+	ayd19m_sk3x4mx_t init = SK3X4MX_INIT;
+	ayd19m_wiegand_t w = { 0 };
+	ayd19m_edge_t e;
+	uint32_t code[4];
+	uint64_t down;
+	size_t i;
+	int j, k;
+
+	sk = init;
+	for (i = 0; i < nrec; i++)
+	{
+		curmode = rec[i].mode;
+		if (rec[i].type == AYD19M_TRACE_FRAME)
+		{
+			if (w.bits) frame(&w, print);
+			continue;
+		}
+
+		st.edges++;
+		e.ts = rec[i].ts;
+		e.line = rec[i].line;
+		e.level = rec[i].level;
+		if (mode() == SK3X4MX)
+		{
+			down = sk3x4mx_edge(&sk, &w, &e);
+			if (down)
+			{
+				k = sk3x4mx_keys(&sk, down, code, 4);
+				for (j = 0; j < k; j++)
+					emit(fmt_SK3X4MX, code[j], 8, print);
+			}
+		}
+		else
+			wiegand_sample(&w, &e);
+	}
+	// trace ended inside a frame
+	if (w.bits) frame(&w, print);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-m mode] [-n passes] [-s] trace...\n"
+			"  -m  decode in reader mode 0..8, default the mode recorded,\n"
+			"      mode 7 only for edges recorded in mode 7 and the reverse\n"
+			"  -n  decode n times, the records are printed once\n"
+			"  -s  print statistics\n",
+			name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	unsigned long passes = 1, p;
+	uint64_t ns;
+	size_t i;
+	int c, stats = 0;
+
+	while ((c = getopt(argc, argv, "m:n:s")) != -1)
+	{
+		switch (c)
+		{
+		case 'm': ay_d19m_mode = atoi(optarg); break;
+		case 'n': passes = strtoul(optarg, NULL, 0); break;
+		case 's': stats = 1; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind >= argc || ay_d19m_mode > K8CDBCD || !passes)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (; optind < argc; optind++)
+		if (load(argv[optind])) return 1;
+	qsort(rec, nrec, sizeof(*rec), byseq);
+
+	// mode 7 logs both edges of D0/D1, the Wiegand modes the falling ones
+	for (i = 0; ay_d19m_mode >= 0 && i < nrec; i++)
+	{
+		if ((rec[i].mode == SK3X4MX) != (ay_d19m_mode == SK3X4MX))
+		{
+			fprintf(stderr, CLASS_NAME ": edges recorded in mode %d can not be decoded in mode %d\n",
+					rec[i].mode, ay_d19m_mode);
+			free(rec);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (p = 0; p < passes; p++)
+		replay(!p);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (stats)
+	{
+		ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * NSEC_PER_SEC + t1.tv_nsec - t0.tv_nsec;
+		fprintf(stderr, CLASS_NAME ": %zu records, %lu edges, %lu frames, %lu bit-errors per pass\n",
+				nrec, st.edges / passes, st.frames / passes, st.biterr / passes);
+		fprintf(stderr, CLASS_NAME ": %lu passes in %llu us, %.1f ns/edge, %.0f frames/s\n", passes,
+				(unsigned long long)ns / 1000, st.edges ? (double)ns / st.edges : 0.0,
+				ns ? st.frames * 1e9 / ns : 0.0);
+	}
+	free(rec);
+	return 0;
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# gpiosim.sh	ayd19md against a gpio-sim chip, needs root, configfs and gpio-sim
+#
+#	make && ./gpiosim.sh [frames]
+#
+# Sends Wiegand 26 frames on the two lines of a simulated chip through the
+# sim_gpioN/pull attributes and checks the records ayd19md writes and the
+# figures it prints with -s. The shell takes some ms a bit, the frames are
+# closed by the -t timeout and the latency shown includes it.
+
+N=${1:-20}
+CFG=/sys/kernel/config/gpio-sim/ayd19m
+T=300		# ms frame timeout, longer than a frame sent by the shell
+DIR=$(mktemp -d)
+PID=
+
+cleanup()
+{
+	if [ -n "$PID" ]; then
+		kill $PID 2>/dev/null
+		wait $PID
+	fi
+	if [ -d $CFG ]; then
+		echo 0 > $CFG/live
+		rmdir $CFG/bank0 $CFG
+	fi
+	rm -rf $DIR
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+modprobe gpio-sim 2>/dev/null
+[ -d /sys/kernel/config/gpio-sim ] || fail "no gpio-sim in configfs"
+mkdir $CFG $CFG/bank0 || fail "can not create $CFG"
+echo 2 > $CFG/bank0/num_lines
+echo 1 > $CFG/live || fail "gpio-sim chip not live"
+CHIP=$(cat $CFG/bank0/chip_name)
+SIM=/sys/devices/platform/$(cat $CFG/dev_name)/$CHIP
+
+# D0 line 0, D1 line 1, idle high
+echo pull-up > $SIM/sim_gpio0/pull
+echo pull-up > $SIM/sim_gpio1/pull
+
+: > $DIR/out		# a file, -o creates a FIFO for a new path
+./ayd19md -c /dev/$CHIP -0 0 -1 1 -m 1 -t $T -o $DIR/out -s 2> $DIR/err &
+PID=$!
+sleep 1
+kill -0 $PID 2>/dev/null || fail "ayd19md: $(cat $DIR/err)"
+
+i=0
+while [ $i -lt $N ]; do
+	fac=$((i * 7 % 256))
+	card=$((i * 1009 % 65536))
+	data=$((fac << 16 | card))
+
+	# even parity over the first 12 data bits, odd over the last 12
+	ep=0
+	op=1
+	b=0
+	while [ $b -lt 12 ]; do
+		ep=$((ep ^ (data >> (12 + b) & 1)))
+		op=$((op ^ (data >> b & 1)))
+		b=$((b + 1))
+	done
+	code=$((ep << 25 | data << 1 | op))
+
+	# the record as decoder.c formats it for mode 1
+	printf 'R=0, M=-1, F=%d, D=%X, L=26\n' $((code >> 16 & 0xFF)) $((code >> 1 & 0xFFFF)) >> $DIR/expect
+
+	# MSB first, a 0 bit is a pulse on D0, a 1 bit on D1
+	b=25
+	while [ $b -ge 0 ]; do
+		l=$((code >> b & 1))
+		echo pull-down > $SIM/sim_gpio$l/pull
+		sleep 0.001
+		echo pull-up > $SIM/sim_gpio$l/pull
+		sleep 0.001
+		b=$((b - 1))
+	done
+	sleep 0.5
+	i=$((i + 1))
+done
+
+kill -INT $PID
+wait $PID
+PID=
+cat $DIR/err
+
+diff -u $DIR/expect $DIR/out || fail "records differ"
+grep -q "frames $N, bit-errors 0, dropped 0" $DIR/err || fail "frame count"
+# falling and rising edge of 26 pulses a frame
+grep -q "events $((N * 52))," $DIR/err || fail "edge events"
+echo "OK: $N frames"